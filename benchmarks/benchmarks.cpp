@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <cpprom/cpprom.hpp>
+
+// Usage: benchmarks [filter]
+// Only runs the benchmarks whose name contains filter. Every benchmark prints the time per
+// operation and the number of heap allocations per operation.
+
+namespace {
+std::atomic<uint64_t> allocations { 0 };
+}
+
+// Counts every heap allocation, so that benchmarks can report allocations per operation.
+// These are not inlined, because GCC would then warn about memory from malloc() being passed to
+// operator delete.
+[[gnu::noinline]] void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+namespace {
+std::string_view filter;
+
+// Keeps the compiler from optimizing away results
+template <typename T>
+void doNotOptimize(const T& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Calls func(iterations) and prints the time and allocations per iteration.
+template <typename Func>
+void bench(std::string_view name, uint64_t iterations, Func&& func)
+{
+    if (name.find(filter) == std::string_view::npos) {
+        return;
+    }
+    const auto startAllocations = allocations.load();
+    const auto start = std::chrono::steady_clock::now();
+    func(iterations);
+    const auto duration = std::chrono::steady_clock::now() - start;
+    const auto allocs = allocations.load() - startAllocations;
+    const auto ns = std::chrono::duration<double, std::nano>(duration).count();
+    std::printf("%-56.*s %14.1f ns/op %10.3f allocs/op %10llu ops\n", static_cast<int>(name.size()),
+        name.data(), ns / static_cast<double>(iterations),
+        static_cast<double>(allocs) / static_cast<double>(iterations),
+        static_cast<unsigned long long>(iterations));
+}
+
+// Runs func(iterationsPerThread) on threads threads at once. Reports the time per operation
+// (over all threads), which shows contention.
+template <typename Func>
+void benchThreads(std::string_view name, size_t threads, uint64_t iterationsPerThread, Func&& func)
+{
+    bench(name, iterationsPerThread * threads, [&](uint64_t) {
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([&] { func(iterationsPerThread); });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    });
+}
+
+void benchIncrement()
+{
+    cpprom::Registry reg;
+    auto& counter = reg.counter("counter_total", "");
+    auto& shardedCounter = reg.counter("sharded_counter_total", "", { true });
+    auto& intCounter = reg.intCounter("int_counter_total", "");
+    auto& gauge = reg.gauge("gauge", "");
+
+    constexpr uint64_t iterations = 20'000'000;
+    bench("Counter::inc", iterations, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            counter.inc();
+        }
+    });
+    bench("Counter::inc (sharded)", iterations, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            shardedCounter.inc();
+        }
+    });
+    bench("IntCounter::inc", iterations, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            intCounter.inc();
+        }
+    });
+    bench("Gauge::inc", iterations, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            gauge.inc();
+        }
+    });
+
+    const auto threads = std::max(std::thread::hardware_concurrency(), 2u);
+    const auto suffix = " (" + std::to_string(threads) + " threads)";
+    benchThreads("Counter::inc" + suffix, threads, iterations / threads, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            counter.inc();
+        }
+    });
+    benchThreads("Counter::inc (sharded)" + suffix, threads, iterations / threads, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            shardedCounter.inc();
+        }
+    });
+    benchThreads("IntCounter::inc" + suffix, threads, iterations / threads, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            intCounter.inc();
+        }
+    });
+    doNotOptimize(counter.value() + shardedCounter.value() + gauge.value());
+    doNotOptimize(intCounter.value());
+}
+
+void benchObserve()
+{
+    std::mt19937 rng(42);
+    std::vector<double> values(4096);
+    for (auto& value : values) {
+        value = std::exponential_distribution<double>(10.0)(rng);
+    }
+
+    constexpr uint64_t iterations = 10'000'000;
+    for (const auto bucketCount : { 1, 10, 30, 100, 1000 }) {
+        cpprom::Registry reg;
+        auto& histogram = reg.histogram(
+            "histogram", cpprom::Histogram::exponentialBuckets(0.0001, 1.5, bucketCount), "");
+        bench("Histogram::observe (" + std::to_string(bucketCount) + " buckets)", iterations,
+            [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; ++i) {
+                    histogram.observe(values[i % values.size()]);
+                }
+            });
+        doNotOptimize(histogram.count());
+    }
+
+    cpprom::Registry reg;
+    auto& nativeHistogram = reg.nativeHistogram("native_histogram", "");
+    bench("NativeHistogram::observe", iterations, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            nativeHistogram.observe(values[i % values.size()]);
+        }
+    });
+    auto& summary = reg.summary("summary", "");
+    bench("Summary::observe", iterations / 10, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            summary.observe(values[i % values.size()]);
+        }
+    });
+
+    auto& histogram = reg.histogram("timed", cpprom::Histogram::defaultBuckets(), "");
+    bench("Histogram::time", iterations, [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            const auto handle = histogram.time();
+        }
+    });
+}
+
+void benchLabels()
+{
+    // Lookups of existing children with two labels. With a hit ratio below 1, the other lookups
+    // create a new child.
+    constexpr size_t existing = 1000;
+    constexpr uint64_t iterations = 2'000'000;
+    std::vector<std::string> methods { "GET", "POST", "PUT", "DELETE" };
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < existing; ++i) {
+        paths.push_back("/api/v1/resource/" + std::to_string(i));
+    }
+    for (const auto hitRatio : { 1.0, 0.99, 0.9, 0.5 }) {
+        cpprom::Registry reg;
+        auto& family = reg.counter("requests_total", { "method", "path" }, "");
+        for (size_t i = 0; i < existing; ++i) {
+            family.labels(methods[i % methods.size()], paths[i]);
+        }
+        // Prepare the label values up front, so that building them is not measured
+        std::mt19937 rng(42);
+        std::bernoulli_distribution hit(hitRatio);
+        std::vector<std::pair<std::string, std::string>> lookups;
+        for (uint64_t i = 0; i < iterations; ++i) {
+            if (hit(rng)) {
+                const auto index = rng() % existing;
+                lookups.emplace_back(methods[index % methods.size()], paths[index]);
+            } else {
+                lookups.emplace_back("GET", "/new/" + std::to_string(i));
+            }
+        }
+        char name[64];
+        std::snprintf(name, sizeof(name), "MetricFamily::labels (%.0f%% hits)", hitRatio * 100.0);
+        bench(name, iterations, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                family.labels(lookups[i].first, lookups[i].second).inc();
+            }
+        });
+    }
+}
+
+void benchSerialize()
+{
+    // Counters with 3 labels, spread over 100 families
+    for (const auto series : { 1'000, 100'000, 1'000'000 }) {
+        cpprom::Registry reg;
+        constexpr size_t families = 100;
+        std::vector<cpprom::MetricFamily<cpprom::Counter>*> counters;
+        for (size_t i = 0; i < families; ++i) {
+            counters.push_back(&reg.counter("family_" + std::to_string(i) + "_total",
+                { "instance", "method", "status" }, "A counter"));
+        }
+        for (int i = 0; i < series; ++i) {
+            counters[i % families]->labels("instance-" + std::to_string(i / 100),
+                i % 2 ? "GET" : "POST", std::to_string(200 + i % 5)).inc(i + 1);
+        }
+
+        const auto iterations = std::max(uint64_t(1), uint64_t(1'000'000 / series));
+        for (const auto format : { cpprom::Format::Text, cpprom::Format::Protobuf }) {
+            const auto formatName = format == cpprom::Format::Text ? "text" : "protobuf";
+            std::string output;
+            cpprom::StringSink sink(output);
+            reg.serialize(sink, format); // Reserves the memory for the output
+            bench("Registry::serialize (" + std::to_string(series) + " series, " + formatName + ")",
+                iterations, [&](uint64_t n) {
+                    for (uint64_t i = 0; i < n; ++i) {
+                        output.clear();
+                        reg.serialize(sink, format);
+                    }
+                });
+            doNotOptimize(output.size());
+        }
+    }
+}
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) {
+        filter = argv[1];
+    }
+    benchIncrement();
+    benchObserve();
+    benchLabels();
+    benchSerialize();
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <array>
 #include <functional>
 #include <iostream>
@@ -8,6 +9,9 @@
 
 #include <cpprom/cpprom.hpp>
 #include <cpprom/processmetrics.hpp>
+#ifdef CPPROM_ZLIB
+#include <cpprom/gzip.hpp>
+#endif
 
 struct Metrics {
     cpprom::MetricFamily<cpprom::Counter>& reqsTotal;
@@ -94,15 +98,49 @@ void serve(uint16_t port, std::function<std::string(std::string_view)> handler)
     }
 }
 
+// Returns the value of the header or an empty string. Does not care about case or folding.
+std::string_view getHeader(std::string_view request, std::string_view name)
+{
+    auto start = request.find("\r\n" + std::string(name) + ":");
+    if (start == std::string_view::npos) {
+        return {};
+    }
+    start += name.size() + 3;
+    const auto value = request.substr(start, request.find("\r\n", start) - start);
+    return value.substr(std::min(value.find_first_not_of(' '), value.size()));
+}
+
 int main()
 {
-    serve(10069, [](std::string_view) {
-        const auto body = cpprom::Registry::getDefault().serialize();
+    serve(10069, [](std::string_view request) {
+        // Prometheus lists the protobuf format in the Accept header, if it prefers it
+        const auto format
+            = getHeader(request, "Accept").find("application/vnd.google.protobuf")
+                != std::string_view::npos
+            ? cpprom::Format::Protobuf
+            : cpprom::Format::Text;
+
+        std::string body;
+        cpprom::StringSink sink(body);
+        std::string contentEncoding;
+#ifdef CPPROM_ZLIB
+        if (cpprom::acceptsGzip(getHeader(request, "Accept-Encoding"))) {
+            // The body is compressed while it is serialized
+            cpprom::GzipSink gzip(sink);
+            cpprom::Registry::getDefault().serialize(gzip, format);
+            gzip.finish();
+            contentEncoding = "Content-Encoding: gzip\r\n";
+        } else
+#endif
+        {
+            cpprom::Registry::getDefault().serialize(sink, format);
+        }
+
         const auto header = "HTTP/1.0 200 OK\r\n"
                             "Connection: close\r\n"
-                            "Content-Type: text/plain; version=0.0.4\r\n"
-                            "Content-Length: "
-            + std::to_string(body.size()) + "\r\n\r\n";
+                            "Content-Type: "
+            + std::string(cpprom::contentType(format)) + "\r\n" + contentEncoding
+            + "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
         return header + body;
     });
     return 1;
@@ -1,17 +1,57 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#ifdef CPPROM_TSC_TIMER
+#if !defined(__x86_64__) && !defined(__i386__)
+#error "CPPROM_TSC_TIMER is only supported on x86"
+#endif
+#include <x86intrin.h>
+#endif
+
 namespace cpprom {
+// Seconds since the Unix epoch (system_clock), e.g. for Gauge::setToCurrentTime()
 double now();
 
 namespace detail {
+    // The clock that the TimeHandles measure durations with. Durations are kept in raw ticks and
+    // only converted to seconds once, when they are recorded.
+    // By default this is std::chrono::steady_clock, which is monotonic. If CPPROM_TSC_TIMER is
+    // defined, it reads the time stamp counter instead, which is cheaper than a clock_gettime.
+    // The frequency of the TSC is calibrated against steady_clock once, when the program starts
+    // (which takes 20ms). Only use it if the CPU has an invariant TSC (constant_tsc and
+    // nonstop_tsc in /proc/cpuinfo), otherwise durations will be wrong if threads migrate between
+    // cores or the frequency changes.
+    struct Timer {
+#ifdef CPPROM_TSC_TIMER
+        using Ticks = uint64_t;
+
+        static Ticks now() { return __rdtsc(); }
+#else
+        using Ticks = std::chrono::steady_clock::rep;
+
+        static Ticks now() { return std::chrono::steady_clock::now().time_since_epoch().count(); }
+#endif
+
+        static double toSeconds(Ticks ticks);
+    };
     // Just to disable moving and copying
     struct HandleBase {
         HandleBase() = default;
@@ -20,15 +60,181 @@ namespace detail {
         HandleBase& operator=(const HandleBase&) = delete;
         HandleBase& operator=(HandleBase&&) = delete;
     };
+
+    // Padded to a cache line, so that shards written by different threads do not share one
+    struct alignas(64) Shard {
+        std::atomic<double> value { 0.0 };
+    };
+
+    // Power of two, based on std::thread::hardware_concurrency()
+    size_t shardCount();
+    // Index of the shard the calling thread should use (before masking with shardCount() - 1)
+    size_t threadShardIndex();
+
+    // Metrics set this after every change, so that a family can tell whether it has to be
+    // serialized again.
+    class ChangeFlag {
+    public:
+        // The change itself has to be a seq_cst atomic operation (the default), because a
+        // weaker store could be reordered after the load here. Then a concurrent reset() could
+        // see the flag still set, clear it and read the old value, without the flag being set
+        // again for the change.
+        void set()
+        {
+            // Only write if necessary, so that not every change invalidates the cache line in
+            // all other cores
+            if (!changed_.load(std::memory_order_seq_cst)) {
+                changed_.store(true, std::memory_order_seq_cst);
+            }
+        }
+
+        // Returns whether it was set. Read the values with seq_cst operations afterwards.
+        bool reset() { return changed_.exchange(false, std::memory_order_seq_cst); }
+
+    private:
+        std::atomic<bool> changed_ { true };
+    };
+
+    // Lets observe() update one of two copies ("hot" and "cold") of the state of a histogram
+    // without locking, while snapshots that are consistent (e.g. the count matches the buckets)
+    // can be taken concurrently. This is how the Go client library does it:
+    // https://github.com/prometheus/client_golang/blob/main/prometheus/histogram.go
+    class HotCold {
+    public:
+        // Returns the index of the copy that has to be updated. Call end() with it afterwards.
+        // This is seq_cst (like startSnapshot()), because it is the change that is ordered
+        // before ChangeFlag::set(): a snapshot after ChangeFlag::reset() waits for it.
+        size_t begin()
+        {
+            return static_cast<size_t>(countAndHotIndex_.fetch_add(1, std::memory_order_seq_cst)
+                >> 63);
+        }
+
+        void end(size_t index) { completed_[index].fetch_add(1, std::memory_order_release); }
+
+        // Makes the hot copy cold and waits until all updates of it are done. Returns the index
+        // of the cold copy and the number of begin() calls it contains.
+        // The caller then reads the cold copy, adds it to the hot copy, resets it and calls
+        // finishSnapshot(). Hold the lock returned by lock() for all of it.
+        std::pair<size_t, uint64_t> startSnapshot();
+        void finishSnapshot(size_t coldIndex, uint64_t count);
+
+        std::unique_lock<std::mutex> lock() { return std::unique_lock(mutex_); }
+
+    private:
+        // The highest bit is the index of the hot copy and the others count the begin() calls
+        std::atomic<uint64_t> countAndHotIndex_ { 0 };
+        std::array<std::atomic<uint64_t>, 2> completed_ { 0, 0 };
+        // The methods of metrics are always thread-safe, even with CPPROM_SINGLE_THREADED
+        std::mutex mutex_;
+    };
 }
 
+#ifdef CPPROM_INTERN_LABELS
+namespace detail {
+    struct InternedString {
+        std::string value;
+        size_t hash; // std::hash<std::string_view>
+    };
+
+    // Returns the same entry for equal strings. Entries are never freed, so this should only be
+    // used for label values that repeat a lot (methods, status codes, endpoints, etc.).
+    const InternedString* intern(std::string_view str);
+
+    // A drop-in for std::vector<std::string> (for the parts of it that are used with label
+    // values), that stores one pointer to a process-wide interned string per value.
+    class InternedLabelValues {
+    public:
+        class const_iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = std::string;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const std::string*;
+            using reference = const std::string&;
+
+            const_iterator(const InternedString* const* it)
+                : it_(it)
+            {
+            }
+
+            const std::string& operator*() const { return (*it_)->value; }
+            const std::string* operator->() const { return &(*it_)->value; }
+
+            const_iterator& operator++()
+            {
+                ++it_;
+                return *this;
+            }
+
+            bool operator==(const const_iterator& other) const { return it_ == other.it_; }
+            bool operator!=(const const_iterator& other) const { return it_ != other.it_; }
+
+        private:
+            const InternedString* const* it_;
+        };
+
+        InternedLabelValues() = default;
+
+        InternedLabelValues(std::initializer_list<std::string_view> values)
+            : InternedLabelValues(values.begin(), values.end())
+        {
+        }
+
+        InternedLabelValues(size_t count, std::string_view value)
+            : values_(count, intern(value))
+        {
+        }
+
+        template <typename Iterator>
+        InternedLabelValues(Iterator first, Iterator last)
+        {
+            for (; first != last; ++first) {
+                emplace_back(*first);
+            }
+        }
+
+        size_t size() const { return values_.size(); }
+        bool empty() const { return values_.empty(); }
+
+        const std::string& operator[](size_t i) const { return values_[i]->value; }
+        const InternedString* interned(size_t i) const { return values_[i]; }
+
+        const_iterator begin() const { return values_.data(); }
+        const_iterator end() const { return values_.data() + values_.size(); }
+
+        void emplace_back(std::string_view value) { values_.push_back(intern(value)); }
+        void push_back(std::string_view value) { emplace_back(value); }
+
+        // Equal strings are the same entry
+        bool operator==(const InternedLabelValues& other) const
+        {
+            return values_ == other.values_;
+        }
+
+        bool operator!=(const InternedLabelValues& other) const { return !(*this == other); }
+
+    private:
+        std::vector<const InternedString*> values_;
+    };
+}
+
+using LabelValues = detail::InternedLabelValues;
+#else
 using LabelValues = std::vector<std::string>;
+#endif
 
 class Counter {
 public:
-    struct Descriptor { };
+    struct Descriptor {
+        // If true, every thread increments one of detail::shardCount() separate cells, which are
+        // summed in value(). This avoids contention on a single atomic, if the counter is
+        // incremented from many threads concurrently, at the cost of memory and a slower value().
+        bool sharded = false;
+    };
 
-    Counter(LabelValues labelValues, const Descriptor& Descriptor);
+    Counter(LabelValues labelValues, const Descriptor& Descriptor,
+        detail::ChangeFlag* changeFlag = nullptr);
 
     void inc(double delta = 1.0);
 
@@ -39,6 +245,9 @@ public:
 private:
     LabelValues labelValues_;
     std::atomic<double> value_ { 0.0 };
+    std::unique_ptr<detail::Shard[]> shards_;
+    size_t shardMask_ = 0;
+    detail::ChangeFlag* changeFlag_;
 };
 
 class Gauge {
@@ -47,7 +256,7 @@ public:
 
     struct TimeHandle : public detail::HandleBase {
         Gauge& gauge;
-        double start;
+        detail::Timer::Ticks start;
 
         TimeHandle(Gauge& gauge);
         ~TimeHandle();
@@ -60,7 +269,8 @@ public:
         ~TrackInProgressHandle();
     };
 
-    Gauge(LabelValues labelValues, const Descriptor& Descriptor);
+    Gauge(LabelValues labelValues, const Descriptor& Descriptor,
+        detail::ChangeFlag* changeFlag = nullptr);
 
     void inc(double delta = 1.0);
 
@@ -79,6 +289,61 @@ public:
 private:
     LabelValues labelValues_;
     std::atomic<double> value_ { 0.0 };
+    detail::ChangeFlag* changeFlag_;
+};
+
+// Like Counter, but only counts whole numbers. inc() is a single atomic fetch_add instead of a
+// compare-and-swap loop and the value is formatted as an integer.
+class IntCounter {
+public:
+    struct Descriptor { };
+
+    IntCounter(LabelValues labelValues, const Descriptor& Descriptor,
+        detail::ChangeFlag* changeFlag = nullptr);
+
+    void inc(uint64_t delta = 1);
+
+    uint64_t value() const;
+
+    const LabelValues& labelValues() const;
+
+private:
+    LabelValues labelValues_;
+    std::atomic<uint64_t> value_ { 0 };
+    detail::ChangeFlag* changeFlag_;
+};
+
+// Like Gauge, but only for whole numbers (e.g. the number of requests in progress)
+class IntGauge {
+public:
+    struct Descriptor { };
+
+    struct TrackInProgressHandle : detail::HandleBase {
+        IntGauge& gauge;
+
+        TrackInProgressHandle(IntGauge& gauge);
+        ~TrackInProgressHandle();
+    };
+
+    IntGauge(LabelValues labelValues, const Descriptor& Descriptor,
+        detail::ChangeFlag* changeFlag = nullptr);
+
+    void inc(int64_t delta = 1);
+
+    void dec(int64_t delta = 1);
+
+    void set(int64_t value);
+
+    TrackInProgressHandle trackInProgress();
+
+    int64_t value() const;
+
+    const LabelValues& labelValues() const;
+
+private:
+    LabelValues labelValues_;
+    std::atomic<int64_t> value_ { 0 };
+    detail::ChangeFlag* changeFlag_;
 };
 
 class Histogram {
@@ -91,39 +356,295 @@ public:
         std::vector<double> bucketBounds;
     };
 
-    struct Bucket {
-        double upperBound;
-        std::atomic<uint64_t> count { 0 };
+    // count is always the sum of bucketCounts and sum is the sum of exactly these observations
+    struct Snapshot {
+        // Unlike the exported _bucket samples, these are not cumulative. bucketCounts[i] is the
+        // number of observations in (upperBounds()[i - 1], upperBounds()[i]].
+        std::vector<uint64_t> bucketCounts;
+        double sum;
+        uint64_t count;
     };
 
     struct TimeHandle : public detail::HandleBase {
         Histogram& histogram;
-        double start;
+        detail::Timer::Ticks start;
 
         TimeHandle(Histogram& histogram);
         ~TimeHandle();
     };
 
-    Histogram(LabelValues labelValues, const Descriptor& Descriptor);
+    Histogram(LabelValues labelValues, const Descriptor& Descriptor,
+        detail::ChangeFlag* changeFlag = nullptr);
 
     void observe(double value);
 
     TimeHandle time();
 
-    const std::vector<Bucket>& buckets() const;
+    // The bucketBounds from the descriptor and +Inf
+    const std::vector<double>& upperBounds() const;
+    Snapshot snapshot() const;
+    // These take a snapshot too
     double sum() const;
     uint64_t count() const;
 
+    const LabelValues& labelValues() const;
+
 private:
+    struct Counts {
+        std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+        std::atomic<double> sum { 0.0 };
+    };
+
     LabelValues labelValues_;
-    std::atomic<double> sum_ { 0.0 };
-    std::vector<Bucket> buckets_;
+    std::vector<double> upperBounds_;
+    // Taking a snapshot moves the counts from one copy to the other
+    mutable detail::HotCold hotCold_;
+    mutable std::array<Counts, 2> counts_;
+    detail::ChangeFlag* changeFlag_;
 };
 
+// A Prometheus native histogram: Buckets are not configured, but have exponentially growing
+// boundaries that are determined by the schema and only buckets that have observations are
+// exported. This gives much higher resolution than Histogram with only a single series.
+// Only the protobuf format supports native histograms. The text format only gets _count, _sum and
+// a single +Inf bucket.
+// https://prometheus.io/docs/specs/native_histograms/
+class NativeHistogram {
+public:
+    struct Descriptor {
+        // The upper bound of bucket i is base^i with base = 2^(2^-schema), i.e. with schema 3
+        // there are 8 buckets per power of two and each is about 9% wider than the previous one.
+        // Must be in [-4, 8].
+        int8_t schema = 3;
+        // Observations with an absolute value of at most zeroThreshold are counted in the zero
+        // bucket. The default is 2^-128, like in the Go client library.
+        double zeroThreshold = 2.938735877055719e-39;
+    };
+
+    struct Snapshot {
+        int8_t schema;
+        double zeroThreshold;
+        uint64_t zeroCount;
+        uint64_t count;
+        double sum;
+        // (bucket index, count) of buckets with a count > 0, sorted by index
+        std::vector<std::pair<int32_t, uint64_t>> positiveBuckets;
+        std::vector<std::pair<int32_t, uint64_t>> negativeBuckets;
+    };
+
+    struct TimeHandle : public detail::HandleBase {
+        NativeHistogram& histogram;
+        detail::Timer::Ticks start;
+
+        TimeHandle(NativeHistogram& histogram);
+        ~TimeHandle();
+    };
+
+    NativeHistogram(LabelValues labelValues, const Descriptor& Descriptor,
+        detail::ChangeFlag* changeFlag = nullptr);
+
+    void observe(double value);
+
+    TimeHandle time();
+
+    // Consistent like Histogram::snapshot()
+    Snapshot snapshot() const;
+    // These take a snapshot too
+    double sum() const;
+    uint64_t count() const;
+
+    const LabelValues& labelValues() const;
+
+    // The index of the bucket that an observation with this absolute value goes into, i.e. the
+    // smallest i with abs(value) <= base^i
+    static int32_t bucketIndex(double value, int8_t schema);
+
+private:
+    // The buckets are allocated in chunks when they are first used, so that observe() never has to
+    // lock and only the range of buckets that is actually used takes memory.
+    class Buckets {
+    public:
+        Buckets(int32_t minIndex, int32_t maxIndex);
+        ~Buckets();
+        Buckets(const Buckets&) = delete;
+        Buckets& operator=(const Buckets&) = delete;
+
+        // index is clamped to [minIndex, maxIndex]
+        void add(int32_t index, uint64_t count);
+        // Appends the buckets with a count > 0 to buckets, adds them to other and resets them
+        void moveTo(Buckets& other, std::vector<std::pair<int32_t, uint64_t>>& buckets);
+
+    private:
+        static constexpr size_t ChunkSize = 256;
+
+        struct Chunk {
+            std::atomic<uint64_t> counts[ChunkSize];
+
+            Chunk();
+        };
+
+        int32_t minIndex_;
+        int32_t maxIndex_;
+        std::unique_ptr<std::atomic<Chunk*>[]> chunks_;
+        size_t chunkCount_;
+    };
+
+    struct Counts {
+        Buckets positive;
+        Buckets negative;
+        std::atomic<uint64_t> zeroCount { 0 };
+        std::atomic<double> sum { 0.0 };
+
+        Counts(int32_t minIndex, int32_t maxIndex);
+    };
+
+    LabelValues labelValues_;
+    int8_t schema_;
+    double zeroThreshold_;
+    // See Histogram
+    mutable detail::HotCold hotCold_;
+    mutable std::array<Counts, 2> counts_;
+    detail::ChangeFlag* changeFlag_;
+};
+
+// https://prometheus.io/docs/concepts/metric_types/#summary
+// Estimates quantiles of the observations of the last maxAge seconds with a DDSketch, which
+// guarantees that the relative error of every quantile is at most relativeAccuracy, no matter the
+// distribution. _count and _sum are cumulative, like for a histogram.
+// https://arxiv.org/abs/1908.10693
+class Summary {
+public:
+    struct Descriptor {
+        std::vector<double> quantiles = { 0.5, 0.9, 0.99 };
+        double relativeAccuracy = 0.01;
+        // The observations are kept in ageBuckets windows that each cover maxAge / ageBuckets
+        // seconds. The quantiles are calculated from all windows that are not older than maxAge.
+        double maxAge = 600.0;
+        size_t ageBuckets = 5;
+        // If a single window needs more buckets, the lowest ones are merged, which only makes
+        // low quantiles of very wide distributions less accurate.
+        size_t maxSketchBuckets = 2048;
+    };
+
+    struct Quantile {
+        double quantile;
+        double value; // NaN if there were no observations in the last maxAge seconds
+    };
+
+    struct TimeHandle : public detail::HandleBase {
+        Summary& summary;
+        detail::Timer::Ticks start;
+
+        TimeHandle(Summary& summary);
+        ~TimeHandle();
+    };
+
+    Summary(LabelValues labelValues, const Descriptor& Descriptor,
+        detail::ChangeFlag* changeFlag = nullptr);
+    ~Summary();
+
+    // Every thread adds to one of detail::shardCount() separate sketches with its own mutex, so
+    // observe() is not contended, unless there are more threads than cores. They are merged when
+    // the quantiles are requested.
+    void observe(double value);
+
+    TimeHandle time();
+
+    std::vector<Quantile> quantiles() const;
+    double sum() const;
+    uint64_t count() const;
+
+    const LabelValues& labelValues() const;
+
+private:
+    struct Shard; // defined in the .cpp, because it uses the sketch
+
+    LabelValues labelValues_;
+    Descriptor descriptor_;
+    std::chrono::steady_clock::time_point start_;
+    std::unique_ptr<Shard[]> shards_;
+    size_t shardMask_;
+    detail::ChangeFlag* changeFlag_;
+};
+
+namespace detail {
+    // Changes whenever the metric changes. Used to find metrics that have been idle.
+    inline std::pair<double, uint64_t> activity(const Counter& counter)
+    {
+        return { counter.value(), 0 };
+    }
+
+    inline std::pair<double, uint64_t> activity(const Gauge& gauge)
+    {
+        return { gauge.value(), 0 };
+    }
+
+    inline std::pair<double, uint64_t> activity(const IntCounter& counter)
+    {
+        return { 0.0, counter.value() };
+    }
+
+    inline std::pair<double, uint64_t> activity(const IntGauge& gauge)
+    {
+        return { static_cast<double>(gauge.value()), 0 };
+    }
+
+    inline std::pair<double, uint64_t> activity(const Histogram& histogram)
+    {
+        const auto snapshot = histogram.snapshot();
+        return { snapshot.sum, snapshot.count };
+    }
+
+    inline std::pair<double, uint64_t> activity(const NativeHistogram& histogram)
+    {
+        const auto snapshot = histogram.snapshot();
+        return { snapshot.sum, snapshot.count };
+    }
+
+    inline std::pair<double, uint64_t> activity(const Summary& summary)
+    {
+        return { summary.sum(), summary.count() };
+    }
+
+    // Metric types that are defined outside of this file (e.g. in multiprocess.hpp) cannot add
+    // overloads here, so they provide it as a member function instead
+    template <typename Metric>
+    std::pair<double, uint64_t> activity(const Metric& metric)
+    {
+        return metric.activity();
+    }
+
+    // Whether the exported values of the metric change without it being updated, e.g. because
+    // a time window expired, so that its ChangeFlag is not enough to tell
+    template <typename Metric>
+    inline constexpr bool changesOverTime = false;
+
+    template <>
+    inline constexpr bool changesOverTime<Summary> = true;
+}
+
+namespace detail {
+    // The memory that the label values take up, excluding the interned strings, which are shared
+    inline size_t labelBytes(const LabelValues& labelValues)
+    {
+#ifdef CPPROM_INTERN_LABELS
+        return labelValues.size() * sizeof(const InternedString*);
+#else
+        size_t bytes = 0;
+        for (const auto& value : labelValues) {
+            bytes += sizeof(std::string) + value.size();
+        }
+        return bytes;
+#endif
+    }
+}
+
 #ifdef CPPROM_SINGLE_THREADED
-#define CPPROM_MUTEX detail::NullMutex
+#define CPPROM_MUTEX ::cpprom::detail::NullMutex
+#define CPPROM_SHARED_MUTEX ::cpprom::detail::NullMutex
 #else
 #define CPPROM_MUTEX std::mutex
+#define CPPROM_SHARED_MUTEX std::shared_mutex
 #endif
 
 namespace detail {
@@ -131,16 +652,173 @@ namespace detail {
         void lock() const { } // BasicLockable
         void unlock() const { } // BasicLockable
         bool try_lock() const { return true; } // Lockable
+        void lock_shared() const { } // SharedMutex
+        void unlock_shared() const { } // SharedMutex
+        bool try_lock_shared() const { return true; } // SharedMutex
     };
 
     bool isValidMetricName(std::string_view str);
     bool isValidLabelName(std::string_view str);
 
+    // Both overloads return the same hash for the same label values
     struct LabelValuesHash {
         size_t operator()(const LabelValues& labelValues) const;
+        size_t operator()(const std::string_view* labelValues, size_t count) const;
+    };
+
+    bool labelValuesEqual(
+        const LabelValues& labelValues, const std::string_view* other, size_t count);
+
+    // Formats labels like in the text exposition format, but without braces: a="x",b="y"
+    std::string renderLabels(
+        const std::vector<std::string>& labelNames, const LabelValues& labelValues);
+
+    // Hands out blocks of a single size from big chunks of memory, so that objects allocated from
+    // it are next to each other in memory. Freed blocks are reused. The chunks are only freed, when
+    // the Slab is destroyed.
+    class Slab {
+    public:
+        Slab() = default;
+        ~Slab();
+        Slab(const Slab&) = delete;
+        Slab& operator=(const Slab&) = delete;
+
+        // All allocations must have the same size and alignment
+        void* allocate(size_t size, size_t alignment);
+        void deallocate(void* block);
+
+    private:
+        struct Chunk {
+            void* memory;
+            size_t blockCount;
+        };
+
+        size_t blockSize_ = 0;
+        size_t alignment_ = 0;
+        std::vector<Chunk> chunks_;
+        size_t usedInLastChunk_ = 0;
+        std::vector<void*> freeBlocks_;
+        // Blocks may be freed from any thread (by the last std::shared_ptr to a metric)
+        CPPROM_MUTEX mutex_;
+    };
+
+    // Keeps the Slab alive, so that it outlives everything that was allocated from it
+    template <typename T>
+    class SlabAllocator {
+    public:
+        using value_type = T;
+
+        SlabAllocator(std::shared_ptr<Slab> slab)
+            : slab_(std::move(slab))
+        {
+        }
+
+        template <typename U>
+        SlabAllocator(const SlabAllocator<U>& other)
+            : slab_(other.slab_)
+        {
+        }
+
+        T* allocate(size_t n)
+        {
+            assert(n == 1);
+            return static_cast<T*>(slab_->allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T* ptr, size_t) { slab_->deallocate(ptr); }
+
+        template <typename U>
+        bool operator==(const SlabAllocator<U>& other) const
+        {
+            return slab_ == other.slab_;
+        }
+
+        template <typename U>
+        bool operator!=(const SlabAllocator<U>& other) const
+        {
+            return slab_ != other.slab_;
+        }
+
+    private:
+        template <typename U>
+        friend class SlabAllocator;
+
+        std::shared_ptr<Slab> slab_;
     };
 }
 
+// https://prometheus.io/docs/instrumenting/exposition_formats/
+enum class Format {
+    Text, // Text format 0.0.4
+    // Length-delimited io.prometheus.client.MetricFamily protobuf messages
+    Protobuf,
+};
+
+// The value of the Content-Type header for a response in that format
+std::string_view contentType(Format format);
+
+// Receives serialized output piece by piece
+class Sink {
+public:
+    virtual ~Sink() = default;
+    virtual void write(std::string_view data) = 0;
+};
+
+// Appends everything to a string. Keep the string around (and clear it) to reuse its memory.
+class StringSink : public Sink {
+public:
+    StringSink(std::string& str)
+        : str_(str)
+    {
+    }
+
+    void write(std::string_view data) override { str_.append(data); }
+
+private:
+    std::string& str_;
+};
+
+// Receives the metrics of a collector one sample at a time, see Collector::collect(SampleVisitor&)
+class SampleVisitor {
+public:
+    // All members reference the collector's own storage and may only be used during the call to
+    // sample().
+    struct SampleRef {
+        std::string_view name;
+        // The name of the sample is name + suffix (e.g. "_bucket"), so it does not have to be built
+        std::string_view suffix;
+        const std::vector<std::string>& labelNames;
+        const LabelValues& labelValues;
+        double value;
+        // An optional label that follows labelNames/labelValues (i.e. "le" of histogram buckets)
+        std::string_view extraLabelName = {};
+        std::string_view extraLabelValue = {};
+        // labelNames and labelValues as returned by detail::renderLabels, if the collector keeps
+        // them around. If this is empty, the text serializer renders them itself.
+        std::string_view renderedLabels = {};
+        // If the value is a whole number (e.g. of an IntCounter or the count of a histogram), it
+        // is also passed here, so it can be formatted exactly and without a float conversion.
+        std::optional<int64_t> integerValue = {};
+    };
+
+    // Like SampleRef, but for a whole native histogram
+    struct NativeHistogramRef {
+        std::string_view name;
+        const std::vector<std::string>& labelNames;
+        const LabelValues& labelValues;
+        const NativeHistogram::Snapshot& snapshot;
+        std::string_view renderedLabels = {};
+    };
+
+    virtual ~SampleVisitor() = default;
+    // Is called before the samples of each family
+    virtual void family(std::string_view name, std::string_view help, std::string_view type) = 0;
+    virtual void sample(const SampleRef& sample) = 0;
+    // The default implementation passes the _bucket{le="+Inf"}, _sum and _count samples of the
+    // histogram to sample(), for visitors that do not support native histograms.
+    virtual void nativeHistogram(const NativeHistogramRef& histogram);
+};
+
 class Collector {
 public:
     struct Sample {
@@ -148,6 +826,8 @@ public:
         double value;
         std::vector<std::string> labelNames = {};
         LabelValues labelValues = {};
+        // See SampleVisitor::SampleRef::integerValue
+        std::optional<int64_t> integerValue = {};
     };
 
     struct Family {
@@ -158,10 +838,32 @@ public:
     };
 
     virtual ~Collector() = default;
-    virtual std::vector<Family> collect() const = 0;
+
+    // A collector has to override at least one of the two collect() overloads, because their
+    // default implementations are written in terms of each other.
+    // Overriding collect(SampleVisitor&) avoids copying the names and labels of every sample.
+    virtual std::vector<Family> collect() const;
+    virtual void collect(SampleVisitor& visitor) const;
+
+    // Writes the collected metrics to sink in the given exposition format
+    virtual void serialize(Sink& sink, Format format = Format::Text) const;
+
+    // Describes the collector for the self-metrics (see makeSelfMetricsCollector)
+    struct Info {
+        // Collectors without a name are exported as "collector_<index in the registry>"
+        std::string name = {};
+        // Only set for families
+        std::optional<size_t> children = {};
+        size_t labelBytes = 0;
+    };
+
+    virtual Info info() const;
 };
 
-std::string serialize(const std::vector<Collector::Family>& families);
+void serialize(
+    Sink& sink, const std::vector<Collector::Family>& families, Format format = Format::Text);
+std::string serialize(
+    const std::vector<Collector::Family>& families, Format format = Format::Text);
 
 template <typename Metric>
 class MetricFamily : public Collector {
@@ -179,58 +881,505 @@ public:
         }
     }
 
+    // Looking up an existing child does not allocate. The label values are only copied, if a new
+    // child has to be created.
+    // If the child is removed (see remove(), clear() and setIdleTimeout()), the returned reference
+    // stays valid for at least retireDelay after that, so using it right away is always safe, even
+    // if another thread removes the child. Changes made through it after the removal are lost.
+    // If you never remove children, you can keep it around forever.
     template <typename... Args>
     Metric& labels(Args&&... args)
     {
+        return getChild<false>(std::forward<Args>(args)...)->metric;
+    }
+
+    // Like labels(), but the returned pointer keeps the metric alive, even if it is removed from
+    // the family. Changes to a removed metric are simply not exported anymore.
+    template <typename... Args>
+    std::shared_ptr<Metric> handle(Args&&... args)
+    {
+        auto child = getChild<true>(std::forward<Args>(args)...);
+        auto& metric = child->metric;
+        return std::shared_ptr<Metric>(std::move(child), &metric);
+    }
+
+    // https://prometheus.io/docs/instrumenting/writing_clientlibs/#labels
+    // Returns whether a child with these label values existed
+    template <typename... Args>
+    bool remove(Args&&... args)
+    {
+        assert(sizeof...(Args) == labelNames_.size());
+        const std::array<std::string_view, sizeof...(Args)> labelValues { std::string_view(
+            args)... };
+        const auto hash = detail::LabelValuesHash {}(labelValues.data(), labelValues.size());
         std::lock_guard g(mutex_);
-        std::vector<std::string> labelValues { static_cast<std::string>(
-            std::forward<Args>(args))... };
-        auto it = metrics_.find(labelValues);
-        if (it == metrics_.end()) {
-            it = metrics_.emplace(labelValues, std::make_unique<Metric>(labelValues, descriptor_))
-                     .first;
+        if (const auto child = find(hash, labelValues.data(), labelValues.size())) {
+            erase(child->get());
+            changeFlag_.set();
+            return true;
         }
-        return *it->second;
+        return false;
     }
 
-    // https://prometheus.io/docs/instrumenting/writing_clientlibs/#labels
-    // TODO: void remove(const LabelValues&);
-    // TODO: void clear();
+    void clear()
+    {
+        std::lock_guard g(mutex_);
+        index_.clear();
+        const auto now = std::chrono::steady_clock::now();
+        for (auto& child : children_) {
+            retired_.push_back({ now, std::move(child) });
+        }
+        children_.clear();
+        overflowChild_.reset();
+        changeFlag_.set();
+    }
+
+    // If maxChildren is greater than 0, labels() and handle() return a single shared overflow
+    // child with all label values set to "__overflow__" instead of creating a new child, once the
+    // family has maxChildren children (not counting the overflow child).
+    // The number of times this happened is exported as <name>_label_overflows_total.
+    // This protects against label values that explode, e.g. because they are derived from
+    // external data.
+    void setMaxChildren(size_t maxChildren)
+    {
+        std::lock_guard g(mutex_);
+        maxChildren_ = maxChildren;
+        overflowName_ = name_ + "_label_overflows_total";
+        changeFlag_.set();
+    }
+
+    uint64_t overflowCount() const { return overflows_.load(); }
+
+    // If timeout is greater than 0, children whose value did not change for more than timeout
+    // seconds are removed whenever the family is serialized or collected. Use this for labels that
+    // are derived from external data (like request paths), which would otherwise accumulate
+    // forever. The value is only compared when collecting, so a child can stay up to one scrape
+    // interval longer than timeout. Like remove(), this invalidates references returned by
+    // labels() after retireDelay, so only keep those around for a short time or use handle().
+    void setIdleTimeout(double timeout)
+    {
+        std::lock_guard g(idleMutex_);
+        idleTimeout_ = timeout;
+    }
 
     const auto& name() const { return name_; }
     const auto& help() const { return help_; }
     const auto& labelNames() const { return labelNames_; }
 
-    std::vector<Family> collect() const override;
+    // How long removed children are kept alive for references returned by labels(), see
+    // freeRetired()
+    static constexpr std::chrono::seconds retireDelay { 10 };
+
+    using Collector::collect;
+    void collect(SampleVisitor& visitor) const override
+    {
+        freeRetired();
+        removeIdle();
+        collectSamples(visitor);
+    }
+
+    // labelBytes is roughly the memory that the label values and the rendered labels of all
+    // children take up
+    Info info() const override
+    {
+        Info info { name_, 0 };
+        for (const auto& child : snapshotChildren()) {
+            ++*info.children;
+            info.labelBytes += detail::labelBytes(child->metric.labelValues());
+            info.labelBytes += child->renderedLabels.capacity();
+        }
+        return info;
+    }
+
+    // If enabled, the serialized output of this family is kept around and only regenerated if
+    // any of its metrics changed since the last time. This is useful for big families that do not
+    // change often, but it needs memory for the output of every format it is serialized in.
+    // Families of summaries are always serialized again, because their quantiles change as the
+    // observations age out of the time windows.
+    void setIncrementalSerialization(bool enabled)
+    {
+        std::lock_guard g(serializedMutex_);
+        incrementalSerialization_ = enabled;
+        serialized_ = {};
+    }
+
+    void serialize(Sink& sink, Format format = Format::Text) const override
+    {
+        std::lock_guard g(serializedMutex_);
+        if (!incrementalSerialization_) {
+            Collector::serialize(sink, format);
+            return;
+        }
+        // This has to happen before the change flag is checked, because it changes the family
+        freeRetired();
+        removeIdle();
+        if (changeFlag_.reset() || detail::changesOverTime<Metric>) {
+            serialized_ = {};
+        }
+        auto& serialized = serialized_[static_cast<size_t>(format)];
+        if (!serialized) {
+            serialized.emplace();
+            StringSink stringSink(*serialized);
+            Samples { *this }.serialize(stringSink, format);
+        }
+        sink.write(*serialized);
+    }
 
 private:
+    // Serializes the samples of a family without removing children again
+    struct Samples : Collector {
+        explicit Samples(const MetricFamily& family)
+            : family(family)
+        {
+        }
+
+        void collect(SampleVisitor& visitor) const override { family.collectSamples(visitor); }
+
+        const MetricFamily& family;
+    };
+
+    struct Child {
+        Child(LabelValues labelValues, const typename Metric::Descriptor& descriptor,
+            const std::vector<std::string>& labelNames, detail::ChangeFlag* changeFlag)
+            : metric(std::move(labelValues), descriptor, changeFlag)
+            , renderedLabels(detail::renderLabels(labelNames, metric.labelValues()))
+            , activity(detail::activity(metric))
+            , lastChange(std::chrono::steady_clock::now())
+        {
+        }
+
+        Metric metric;
+        // The label values never change, so we only format them once
+        std::string renderedLabels;
+        size_t hash = 0;
+        size_t index = 0; // in children_
+
+        // Only used by removeIdle
+        std::pair<double, uint64_t> activity;
+        std::chrono::steady_clock::time_point lastChange;
+    };
+
+    struct Retired {
+        std::chrono::steady_clock::time_point time;
+        std::shared_ptr<Child> child;
+    };
+
+    // Specialized for every metric type
+    void collectSamples(SampleVisitor& visitor) const;
+
+    // If Shared is true, this returns a std::shared_ptr<Child>, otherwise a Child*, which
+    // avoids modifying the reference count (which is shared by all threads) for every lookup.
+    template <bool Shared, typename... Args>
+    auto getChild(Args&&... args)
+    {
+        assert(sizeof...(Args) == labelNames_.size());
+        const std::array<std::string_view, sizeof...(Args)> labelValues { std::string_view(
+            args)... };
+        const auto hash = detail::LabelValuesHash {}(labelValues.data(), labelValues.size());
+        // This has to be done while holding the lock, because the child might be removed otherwise
+        const auto result = [](const std::shared_ptr<Child>& child) {
+            if constexpr (Shared) {
+                return child;
+            } else {
+                return child.get();
+            }
+        };
+        {
+            // Most of the time the child already exists, so many threads may look it up at once
+            std::shared_lock g(mutex_);
+            if (const auto child = find(hash, labelValues.data(), labelValues.size())) {
+                return result(*child);
+            }
+        }
+        std::lock_guard g(mutex_);
+        // Another thread might have inserted it, while we were not holding the lock
+        if (const auto child = find(hash, labelValues.data(), labelValues.size())) {
+            return result(*child);
+        }
+        if (maxChildren_ > 0 && children_.size() - (overflowChild_ ? 1 : 0) >= maxChildren_) {
+            overflows_++;
+            changeFlag_.set();
+            return result(getOverflowChild());
+        }
+        return result(insert(hash, LabelValues(labelValues.begin(), labelValues.end())));
+    }
+
+    // mutex_ has to be locked exclusively
+    const std::shared_ptr<Child>& insert(size_t hash, LabelValues labelValues)
+    {
+        auto child = std::allocate_shared<Child>(detail::SlabAllocator<Child>(slab_),
+            std::move(labelValues), descriptor_, labelNames_, &changeFlag_);
+        child->hash = hash;
+        child->index = children_.size();
+        index_.emplace(hash, child.get());
+        children_.push_back(std::move(child));
+        changeFlag_.set();
+        return children_.back();
+    }
+
+    // mutex_ has to be locked exclusively
+    const std::shared_ptr<Child>& getOverflowChild()
+    {
+        if (!overflowChild_) {
+            LabelValues labelValues(labelNames_.size(), "__overflow__");
+            const auto hash = detail::LabelValuesHash {}(labelValues);
+            overflowChild_ = insert(hash, std::move(labelValues));
+        }
+        return overflowChild_;
+    }
+
+    // mutex_ has to be locked exclusively
+    void erase(Child* child) const
+    {
+        const auto [begin, end] = index_.equal_range(child->hash);
+        for (auto it = begin; it != end; ++it) {
+            if (it->second == child) {
+                index_.erase(it);
+                break;
+            }
+        }
+        if (children_[child->index] == overflowChild_) {
+            overflowChild_.reset();
+        }
+        // Move the last child into the gap, so children_ stays contiguous
+        const auto index = child->index;
+        if (index != children_.size() - 1) {
+            std::swap(children_[index], children_.back());
+            children_[index]->index = index;
+        }
+        retired_.push_back({ std::chrono::steady_clock::now(), std::move(children_.back()) });
+        children_.pop_back();
+    }
+
+    // Destroys the children that were removed more than retireDelay ago. Removed children are
+    // kept around for a while, because other threads might still be using a reference from
+    // labels(), which can not keep them alive without making every lookup modify the reference
+    // count.
+    void freeRetired() const
+    {
+        const auto cutoff = std::chrono::steady_clock::now() - retireDelay;
+        {
+            std::shared_lock g(mutex_);
+            if (retired_.empty() || retired_.front().time > cutoff) {
+                return;
+            }
+        }
+        std::vector<Retired> expired;
+        {
+            std::lock_guard g(mutex_);
+            // retired_ is ordered by time, because children are only ever appended
+            const auto end = std::find_if(retired_.begin(), retired_.end(),
+                [cutoff](const Retired& retired) { return retired.time > cutoff; });
+            expired.assign(std::make_move_iterator(retired_.begin()), std::make_move_iterator(end));
+            retired_.erase(retired_.begin(), end);
+        }
+        // expired is destroyed here, without holding mutex_
+    }
+
+    // mutex_ has to be locked (shared is enough)
+    void collectOverflows(SampleVisitor& visitor) const
+    {
+        if (maxChildren_ == 0) {
+            return;
+        }
+        static const std::vector<std::string> labelNames;
+        static const LabelValues labelValues;
+        visitor.family(overflowName_,
+            "Number of times a new label set was counted in the overflow child instead, because "
+            "the family had too many children.",
+            "counter");
+        visitor.sample(SampleVisitor::SampleRef {
+            overflowName_, {}, labelNames, labelValues, static_cast<double>(overflows_.load()) });
+    }
+
+    const std::shared_ptr<Child>* find(
+        size_t hash, const std::string_view* labelValues, size_t count) const
+    {
+        const auto [begin, end] = index_.equal_range(hash);
+        for (auto it = begin; it != end; ++it) {
+            if (detail::labelValuesEqual(it->second->metric.labelValues(), labelValues, count)) {
+                return &children_[it->second->index];
+            }
+        }
+        return nullptr;
+    }
+
+    // Collecting works on a copy of the list of children, so that labels() only has to wait for
+    // the copy to be made and not for the whole family to be collected. This also keeps removed
+    // children alive until they are collected.
+    std::vector<std::shared_ptr<Child>> snapshotChildren() const
+    {
+        std::shared_lock g(mutex_);
+        return children_;
+    }
+
+    void removeIdle() const
+    {
+        std::lock_guard ig(idleMutex_);
+        if (idleTimeout_ <= 0.0) {
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        const auto timeout = std::chrono::duration<double>(idleTimeout_);
+        bool anyIdle = false;
+        // Only idleMutex_ protects the activity members, so mutex_ does not have to be locked
+        for (const auto& child : snapshotChildren()) {
+            const auto activity = detail::activity(child->metric);
+            if (activity != child->activity) {
+                child->activity = activity;
+                child->lastChange = now;
+            } else if (now - child->lastChange > timeout) {
+                anyIdle = true;
+            }
+        }
+        if (!anyIdle) {
+            return;
+        }
+        std::lock_guard g(mutex_);
+        for (size_t i = 0; i < children_.size();) {
+            auto& child = *children_[i];
+            if (now - child.lastChange > timeout) {
+                // The child might have been changed since the snapshot. While mutex_ is locked
+                // exclusively, labels() can not hand it out anymore, so check once more.
+                const auto activity = detail::activity(child.metric);
+                if (activity == child.activity) {
+                    erase(&child); // This moves another child to i
+                    continue;
+                }
+                child.activity = activity;
+                child.lastChange = now;
+            }
+            ++i;
+        }
+        changeFlag_.set();
+    }
+
     std::string name_;
     std::string help_;
     std::vector<std::string> labelNames_;
     typename Metric::Descriptor descriptor_;
 
-    std::unordered_map<LabelValues, std::unique_ptr<Metric>, detail::LabelValuesHash> metrics_;
-    mutable CPPROM_MUTEX mutex_;
+    // The children are allocated from slab_, so they are close together in memory and
+    // children_ is iterated when collecting, instead of the scattered nodes of index_.
+    // These are mutable, because collect() removes idle children.
+    std::shared_ptr<detail::Slab> slab_ = std::make_shared<detail::Slab>();
+    mutable std::vector<std::shared_ptr<Child>> children_;
+    // Keyed by detail::LabelValuesHash, because C++17 unordered containers cannot be searched
+    // with a key type other than the one they store (i.e. string_views instead of LabelValues).
+    // The label values themselves are only stored in the metric.
+    mutable std::unordered_multimap<size_t, Child*> index_;
+    // Removed children, see freeRetired()
+    mutable std::vector<Retired> retired_;
+    mutable CPPROM_SHARED_MUTEX mutex_;
+
+    double idleTimeout_ = 0.0;
+    mutable CPPROM_MUTEX idleMutex_;
+
+    // These are protected by mutex_
+    size_t maxChildren_ = 0;
+    std::string overflowName_;
+    mutable std::shared_ptr<Child> overflowChild_;
+    std::atomic<uint64_t> overflows_ { 0 };
+
+    mutable detail::ChangeFlag changeFlag_;
+    bool incrementalSerialization_ = false;
+    mutable std::array<std::optional<std::string>, 2> serialized_; // Indexed by Format
+    mutable CPPROM_MUTEX serializedMutex_;
+};
+
+// Like MetricFamily, but the number of labels is part of the type, so that calling labels() with
+// the wrong number of arguments does not compile.
+template <typename Metric, size_t N>
+class StaticMetricFamily : public MetricFamily<Metric> {
+public:
+    StaticMetricFamily(std::string name, std::array<std::string, N> labelNames, std::string help,
+        typename Metric::Descriptor descriptor = {})
+        : MetricFamily<Metric>(std::move(name),
+            std::vector<std::string>(std::make_move_iterator(labelNames.begin()),
+                std::make_move_iterator(labelNames.end())),
+            std::move(help), std::move(descriptor))
+    {
+    }
+
+    // Unless you remove children, the returned reference stays valid for the lifetime of the
+    // family, so keep it around to skip the lookup entirely in hot paths.
+    template <typename... Args>
+    Metric& labels(Args&&... args)
+    {
+        static_assert(sizeof...(Args) == N, "Wrong number of label values");
+        return MetricFamily<Metric>::labels(std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    std::shared_ptr<Metric> handle(Args&&... args)
+    {
+        static_assert(sizeof...(Args) == N, "Wrong number of label values");
+        return MetricFamily<Metric>::handle(std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    bool remove(Args&&... args)
+    {
+        static_assert(sizeof...(Args) == N, "Wrong number of label values");
+        return MetricFamily<Metric>::remove(std::forward<Args>(args)...);
+    }
 };
 
 template <>
-std::vector<Collector::Family> MetricFamily<Counter>::collect() const;
+void MetricFamily<Counter>::collectSamples(SampleVisitor& visitor) const;
 
 template <>
-std::vector<Collector::Family> MetricFamily<Gauge>::collect() const;
+void MetricFamily<Gauge>::collectSamples(SampleVisitor& visitor) const;
 
 template <>
-std::vector<Collector::Family> MetricFamily<Histogram>::collect() const;
+void MetricFamily<IntCounter>::collectSamples(SampleVisitor& visitor) const;
 
-std::shared_ptr<MetricFamily<Counter>> makeCounter(
-    std::string name, std::vector<std::string> labelNames, std::string help);
+template <>
+void MetricFamily<IntGauge>::collectSamples(SampleVisitor& visitor) const;
+
+template <>
+void MetricFamily<Histogram>::collectSamples(SampleVisitor& visitor) const;
+
+template <>
+void MetricFamily<NativeHistogram>::collectSamples(SampleVisitor& visitor) const;
+
+template <>
+void MetricFamily<Summary>::collectSamples(SampleVisitor& visitor) const;
+
+std::shared_ptr<MetricFamily<Counter>> makeCounter(std::string name,
+    std::vector<std::string> labelNames, std::string help, Counter::Descriptor descriptor = {});
 
 std::shared_ptr<MetricFamily<Gauge>> makeGauge(
     std::string name, std::vector<std::string> labelNames, std::string help);
 
+std::shared_ptr<MetricFamily<IntCounter>> makeIntCounter(
+    std::string name, std::vector<std::string> labelNames, std::string help);
+
+std::shared_ptr<MetricFamily<IntGauge>> makeIntGauge(
+    std::string name, std::vector<std::string> labelNames, std::string help);
+
 std::shared_ptr<MetricFamily<Histogram>> makeHistogram(std::string name,
     std::vector<std::string> labelNames, std::vector<double> bucketBounds, std::string help);
 
+std::shared_ptr<MetricFamily<NativeHistogram>> makeNativeHistogram(std::string name,
+    std::vector<std::string> labelNames, std::string help,
+    NativeHistogram::Descriptor descriptor = {});
+
+std::shared_ptr<MetricFamily<Summary>> makeSummary(std::string name,
+    std::vector<std::string> labelNames, std::string help, Summary::Descriptor descriptor = {});
+
+class Registry;
+
+// Exports metrics about the collectors of registry, to find the ones that make scraping slow:
+// cpprom_collector_serialize_duration_seconds{collector} and cpprom_collector_serialize_bytes
+//     of the last Registry::serialize(), which is the previous scrape while the registry is being
+//     scraped (i.e. while this collector is serialized)
+// cpprom_collector_collect_duration_seconds{collector} of the last Registry::collect()
+// cpprom_family_children{family} and cpprom_family_label_bytes{family} for every family
+// The collector label is Collector::Info::name, which is the name of families.
+// Register it in the same registry. Every collection goes through the children of all families.
+std::shared_ptr<Collector> makeSelfMetricsCollector(const Registry& registry);
+
 class Registry {
 public:
     // The docs tell me I should provide this
@@ -241,27 +1390,120 @@ public:
     Registry(const Registry&) = default;
     Registry(Registry&&) = default;
 
-    MetricFamily<Counter>& counter(
-        std::string name, std::vector<std::string> labelNames, std::string help);
+    MetricFamily<Counter>& counter(std::string name, std::vector<std::string> labelNames,
+        std::string help, Counter::Descriptor descriptor = {});
 
-    Counter& counter(std::string name, std::string help);
+    Counter& counter(std::string name, std::string help, Counter::Descriptor descriptor = {});
 
     MetricFamily<Gauge>& gauge(
         std::string name, std::vector<std::string> labelNames, std::string help);
 
     Gauge& gauge(std::string name, std::string help);
 
+    MetricFamily<IntCounter>& intCounter(
+        std::string name, std::vector<std::string> labelNames, std::string help);
+
+    IntCounter& intCounter(std::string name, std::string help);
+
+    MetricFamily<IntGauge>& intGauge(
+        std::string name, std::vector<std::string> labelNames, std::string help);
+
+    IntGauge& intGauge(std::string name, std::string help);
+
     MetricFamily<Histogram>& histogram(std::string name, std::vector<std::string> labelNames,
         std::vector<double> bucketBounds, std::string help);
 
     Histogram& histogram(std::string name, std::vector<double> bucketBounds, std::string help);
 
+    MetricFamily<NativeHistogram>& nativeHistogram(std::string name,
+        std::vector<std::string> labelNames, std::string help,
+        NativeHistogram::Descriptor descriptor = {});
+
+    NativeHistogram& nativeHistogram(
+        std::string name, std::string help, NativeHistogram::Descriptor descriptor = {});
+
+    MetricFamily<Summary>& summary(std::string name, std::vector<std::string> labelNames,
+        std::string help, Summary::Descriptor descriptor = {});
+
+    Summary& summary(std::string name, std::string help, Summary::Descriptor descriptor = {});
+
+    // e.g. reg.staticFamily<cpprom::Counter, 2>("requests_total", { "method", "uri" }, "...")
+    template <typename Metric, size_t N>
+    StaticMetricFamily<Metric, N>& staticFamily(std::string name,
+        std::array<std::string, N> labelNames, std::string help,
+        typename Metric::Descriptor descriptor = {})
+    {
+        auto f = std::make_shared<StaticMetricFamily<Metric, N>>(
+            std::move(name), std::move(labelNames), std::move(help), std::move(descriptor));
+        registerCollector(f);
+        return *f;
+    }
+
     Registry& registerCollector(std::shared_ptr<Collector> collector);
 
-    std::string serialize() const;
+    // Visits all collectors in the order they were registered
+    void collect(SampleVisitor& visitor) const;
+
+    std::string serialize(Format format = Format::Text) const;
+
+    // Streams the output to sink in chunks of at most about chunkSize bytes instead of building
+    // all of it in memory first.
+    // If the scrape cache is enabled, the output of serializeCached() is written instead.
+    void serialize(Sink& sink, Format format = Format::Text, size_t chunkSize = 64 * 1024) const;
+
+    // If maxAge is greater than 0, serialize() returns the output of a previous call (with the same
+    // format), if it started at most maxAge seconds ago. If the output is too old and another
+    // thread is already serializing, serialize() waits for it to be done and returns its output.
+    // This is useful if multiple scrapers scrape the same process at almost the same time.
+    // It is disabled by default.
+    void setCacheMaxAge(double maxAge);
+
+    // Uses the scrape cache even if it is disabled (i.e. maxAge is 0), in which case it only makes
+    // concurrent calls share the work.
+    std::shared_ptr<const std::string> serializeCached(Format format = Format::Text) const;
+
+    // If threads is greater than 1, serialize() collects up to that many collectors at once
+    // (with threads - 1 additional threads per call). The output of every collector is buffered
+    // and written in the order they were registered, so it is the same as with a single thread.
+    // This helps if there are many collectors that are slow to collect (e.g. because they read
+    // files). It is disabled by default.
+    // The threads are started for every serialization and not kept around, which costs tens of
+    // microseconds per thread, so only use this if collecting takes considerably longer than that.
+    // If a collector throws, the first exception is rethrown after all threads have finished.
+    // With CPPROM_SINGLE_THREADED this is always 1.
+    void setCollectionThreads(size_t threads);
+
+    // How long the collectors took the last time they were serialized or collected, see
+    // makeSelfMetricsCollector
+    struct CollectorStats {
+        std::shared_ptr<Collector> collector;
+        double serializeSeconds = 0.0;
+        uint64_t serializeBytes = 0;
+        double collectSeconds = 0.0;
+    };
+
+    std::vector<CollectorStats> collectorStats() const;
 
 private:
+    struct CacheEntry {
+        std::shared_ptr<const std::string> output;
+        std::chrono::steady_clock::time_point time;
+        bool inProgress = false;
+    };
+
+    bool cacheEnabled() const;
+    void serializeUncached(Sink& sink, Format format) const;
+
     std::vector<std::shared_ptr<Collector>> collectors_;
     mutable CPPROM_MUTEX mutex_;
+    // Separate from mutex_, so the self-metrics can be collected while serializing
+    mutable std::vector<CollectorStats> stats_;
+    mutable CPPROM_MUTEX statsMutex_;
+    size_t collectionThreads_ = 1;
+
+    double cacheMaxAge_ = 0.0;
+    mutable std::array<CacheEntry, 2> cache_; // Indexed by Format
+    mutable CPPROM_MUTEX cacheMutex_;
+    mutable std::condition_variable_any cacheDone_;
 };
 }
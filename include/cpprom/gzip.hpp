@@ -0,0 +1,47 @@
+#pragma once
+
+#include "cpprom.hpp"
+
+namespace cpprom {
+/*
+
+    Compresses everything written to it with gzip (using zlib) and passes the compressed data on to
+    another sink. Use it with Registry::serialize(Sink&, ...) to compress the output while it is
+    being serialized, so that the uncompressed output never has to be held in memory in full:
+
+        cpprom::GzipSink gzip(sink);
+        registry.serialize(gzip, format);
+        gzip.finish();
+
+    Only use it if the scraper sent "gzip" in Accept-Encoding (see acceptsGzip) and set the
+    Content-Encoding header of the response to "gzip".
+
+*/
+class GzipSink : public Sink {
+public:
+    // level is the zlib compression level from 0 to 9, -1 is zlib's default (6)
+    GzipSink(Sink& sink, int level = -1, size_t bufferSize = 16 * 1024);
+    ~GzipSink();
+
+    GzipSink(const GzipSink&) = delete;
+    GzipSink& operator=(const GzipSink&) = delete;
+
+    void write(std::string_view data) override;
+
+    // Writes the remaining compressed data and the gzip trailer. Nothing may be written after this.
+    // It is called by the destructor, if it has not been called before.
+    void finish();
+
+private:
+    void deflate(int flush);
+
+    struct Stream; // Avoids the zlib include
+    Sink& sink_;
+    std::unique_ptr<Stream> stream_;
+    std::string buffer_;
+    bool finished_ = false;
+};
+
+// Takes the value of an Accept-Encoding header and returns whether it allows gzip
+bool acceptsGzip(std::string_view acceptEncoding);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <thread>
+
+#include "cpprom.hpp"
+
+namespace cpprom {
+/*
+
+    A small HTTP/1.1 server that serves the metrics of a registry on its own thread, so scrapes do
+    not compete with the threads of the application:
+
+        cpprom::HttpServer server(registry, { 9100 });
+
+    All connections are handled by that single thread with epoll and are kept alive between
+    scrapes (unless the client asks otherwise). The output is taken from Registry::serializeCached,
+    so scrapers that arrive at almost the same time share one serialization (see also
+    Registry::setCacheMaxAge), and the response is sent with writev straight from the cached
+    output, without copying it. If CPPROM_ZLIB is defined, responses are gzipped if the client
+    accepts it, which does require a copy.
+
+    Only GET and HEAD requests to options.path are answered (with 200), everything else gets a 404
+    or 405. Request bodies are not supported. The protobuf format is served if the Accept header
+    asks for it, like Prometheus does.
+
+    Since the registry is serialized on another thread, do not use CPPROM_SINGLE_THREADED.
+    This is Linux only and built as the separate cpprom_http library (cpprom_http_dep in meson).
+
+*/
+class HttpServer {
+public:
+    struct Options {
+        uint16_t port = 9100;
+        // An IPv4 address to bind to
+        std::string address = "0.0.0.0";
+        std::string path = "/metrics";
+        // Connections without any activity for this many seconds are closed
+        double idleTimeout = 60.0;
+        // Further connections are closed right after they are accepted
+        size_t maxConnections = 64;
+    };
+
+    // If the socket cannot be bound, an error is printed and listening() returns false
+    HttpServer(const Registry& registry, Options options);
+    ~HttpServer();
+
+    HttpServer(const HttpServer&) = delete;
+    HttpServer& operator=(const HttpServer&) = delete;
+
+    bool listening() const;
+
+    // The port that was bound, which is useful if options.port was 0
+    uint16_t port() const;
+
+private:
+    struct Connection; // Avoids the system includes
+
+    void run();
+    void accept();
+    void close(int fd);
+    // Returns false if the connection was closed
+    bool receive(Connection& connection);
+    bool respond(Connection& connection);
+    bool flush(Connection& connection);
+
+    const Registry& registry_;
+    Options options_;
+    uint16_t port_ = 0;
+    int listenSocket_ = -1;
+    int epollFd_ = -1;
+    int stopEvent_ = -1;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+    std::thread thread_;
+};
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include "cpprom.hpp"
+
+namespace cpprom {
+/*
+
+    For servers with multiple (e.g. pre-forked) worker processes, that should be scraped as a single
+    target. This works like the multiprocess mode of the Python client library:
+    https://prometheus.github.io/client_python/multiprocess/
+
+    Every worker creates a SharedMemorySegment in a directory that all of them share, which is a
+    file (<directory>/<pid>.cpprom) mapped into memory. The values of SharedCounter, SharedGauge
+    and SharedHistogram live in that file, so they are updated with plain atomic operations, like
+    the regular metrics, and no IPC is needed. A single exporter process serves the collector from
+    makeMultiProcessCollector(), which maps all files in the directory and aggregates them:
+
+        // In every worker, after fork()
+        auto segment = std::make_shared<cpprom::SharedMemorySegment>("/run/app-metrics");
+        auto requests = cpprom::makeSharedCounter(segment, "requests_total", { "method" }, "...");
+        requests->labels("GET").inc();
+
+        // In the exporter
+        registry.registerCollector(cpprom::makeMultiProcessCollector("/run/app-metrics"));
+
+    Counters and histograms are summed across all processes. Gauges are exported per process with
+    an additional "pid" label by default, or can be aggregated with a SharedGauge::Mode.
+    The files of exited processes are left in place, so their counters do not go backwards. Empty
+    the directory when the whole server (re)starts. Their gauges are not exported anymore (in
+    every mode, like livesum and liveall of the Python client), because they would keep the last
+    value forever. Whether a process is alive is checked with kill(pid, 0), so the exporter has to
+    be in the same pid namespace as the workers.
+
+    Every series takes a fixed-size slot in the segment, which is kept if the child is removed from
+    the family and is shared with later children with the same labels. If the segment is full, an
+    error is printed and the metrics of new series still work, but are not exported.
+
+    The families can be registered in the registry of the worker as well, which only exports the
+    values of that worker.
+
+*/
+namespace detail {
+    struct SegmentHeader; // Defined in the .cpp, because it is only the layout of the file
+}
+
+class SharedMemorySegment {
+public:
+    // If the file cannot be created or mapped, an error is printed and all slots are in process
+    // memory (see mapped())
+    SharedMemorySegment(const std::string& directory, size_t size = 1024 * 1024);
+    ~SharedMemorySegment();
+
+    SharedMemorySegment(const SharedMemorySegment&) = delete;
+    SharedMemorySegment& operator=(const SharedMemorySegment&) = delete;
+
+    bool mapped() const;
+
+    // Returns valueCount zero-initialized and 8-byte aligned values for the series identified by
+    // key. Calling it again with the same key and valueCount returns the same values.
+    void* allocate(std::string_view key, uint32_t valueCount);
+
+private:
+    detail::SegmentHeader* header_ = nullptr;
+    size_t size_ = 0;
+    CPPROM_MUTEX mutex_;
+    std::unordered_map<std::string, void*> slots_;
+    // If the segment is not mapped or full
+    std::vector<std::unique_ptr<uint64_t[]>> fallbackSlots_;
+};
+
+class SharedCounter {
+public:
+    // Filled in by makeSharedCounter
+    struct Descriptor {
+        std::shared_ptr<SharedMemorySegment> segment;
+        std::string key;
+    };
+
+    SharedCounter(LabelValues labelValues, const Descriptor& descriptor,
+        detail::ChangeFlag* changeFlag = nullptr);
+
+    void inc(double delta = 1.0);
+
+    double value() const;
+
+    const LabelValues& labelValues() const;
+
+    std::pair<double, uint64_t> activity() const;
+
+private:
+    LabelValues labelValues_;
+    // Keeps value_ alive
+    std::shared_ptr<SharedMemorySegment> segment_;
+    std::atomic<double>* value_;
+    detail::ChangeFlag* changeFlag_;
+};
+
+class SharedGauge {
+public:
+    // How the values of all processes are exported by the multiprocess collector
+    enum class Mode {
+        All, // One series per process with an additional "pid" label
+        Sum,
+        Min,
+        Max,
+    };
+
+    // Filled in by makeSharedGauge
+    struct Descriptor {
+        std::shared_ptr<SharedMemorySegment> segment;
+        std::string key;
+    };
+
+    SharedGauge(LabelValues labelValues, const Descriptor& descriptor,
+        detail::ChangeFlag* changeFlag = nullptr);
+
+    void inc(double delta = 1.0);
+
+    void dec(double delta = 1.0);
+
+    void set(double value);
+
+    double value() const;
+
+    const LabelValues& labelValues() const;
+
+    std::pair<double, uint64_t> activity() const;
+
+private:
+    LabelValues labelValues_;
+    std::shared_ptr<SharedMemorySegment> segment_;
+    std::atomic<double>* value_;
+    detail::ChangeFlag* changeFlag_;
+};
+
+class SharedHistogram {
+public:
+    // Filled in by makeSharedHistogram
+    struct Descriptor {
+        std::shared_ptr<SharedMemorySegment> segment;
+        std::string key;
+        std::vector<double> bucketBounds;
+    };
+
+    SharedHistogram(LabelValues labelValues, const Descriptor& descriptor,
+        detail::ChangeFlag* changeFlag = nullptr);
+
+    void observe(double value);
+
+    // The bucketBounds from the descriptor and +Inf
+    const std::vector<double>& upperBounds() const;
+    // Unlike Histogram::snapshot(), the count might not match the buckets and the sum exactly, if
+    // there are concurrent observations.
+    Histogram::Snapshot snapshot() const;
+
+    const LabelValues& labelValues() const;
+
+    std::pair<double, uint64_t> activity() const;
+
+private:
+    LabelValues labelValues_;
+    std::vector<double> upperBounds_;
+    std::shared_ptr<SharedMemorySegment> segment_;
+    // The slot in the segment holds one (non-cumulative) count per upper bound (including +Inf),
+    // followed by the sum. The bounds themselves are part of the key of the family.
+    std::atomic<uint64_t>* bucketCounts_;
+    std::atomic<double>* sum_;
+    detail::ChangeFlag* changeFlag_;
+};
+
+template <>
+void MetricFamily<SharedCounter>::collectSamples(SampleVisitor& visitor) const;
+
+template <>
+void MetricFamily<SharedGauge>::collectSamples(SampleVisitor& visitor) const;
+
+template <>
+void MetricFamily<SharedHistogram>::collectSamples(SampleVisitor& visitor) const;
+
+std::shared_ptr<MetricFamily<SharedCounter>> makeSharedCounter(
+    std::shared_ptr<SharedMemorySegment> segment, std::string name,
+    std::vector<std::string> labelNames, std::string help);
+
+std::shared_ptr<MetricFamily<SharedGauge>> makeSharedGauge(
+    std::shared_ptr<SharedMemorySegment> segment, std::string name,
+    std::vector<std::string> labelNames, std::string help,
+    SharedGauge::Mode mode = SharedGauge::Mode::All);
+
+std::shared_ptr<MetricFamily<SharedHistogram>> makeSharedHistogram(
+    std::shared_ptr<SharedMemorySegment> segment, std::string name,
+    std::vector<std::string> labelNames, std::vector<double> bucketBounds, std::string help);
+
+// Aggregates the segments of all processes in directory whenever it is collected
+std::shared_ptr<Collector> makeMultiProcessCollector(std::string directory);
+}
@@ -13,7 +13,8 @@ namespace cpprom {
         with utime and stime from /proc/[fd]/stat and userHZ = sysconf(_SC_CLK_TCK)
 
     process_open_fds = num items in /proc/self/fd/
-        it seems there is no better way from C(++)
+        it seems there is no better way from C(++). The directory is kept open and read with
+        getdents64 and the fds that the collector keeps open itself are not counted.
 
     process_max_fds = getrlimit(RLIMIT_NOFILE) soft limit
 
@@ -29,9 +30,42 @@ namespace cpprom {
 
     process_threads = num_threads from /proc/[fd]/stat
 
+    /proc/self/stat is kept open and read with pread on every collection. userHZ, the page size and
+    the start time never change, so they are only determined once, when the collector is created.
+
     process_heap_bytes is omitted purposely, because I am not sure how to do it or if it makes sense
 
  */
 
 std::shared_ptr<cpprom::Collector> makeProcessMetricsCollector();
+
+/*
+    Exports metrics that are not part of the standard process metrics, but help to explain
+    latency. Register it in addition to the collector above. Metrics that are not available (e.g.
+    without cgroup v2 or if /proc/self/io is not readable) are omitted.
+    The files are kept open like above, so they count towards process_open_fds.
+
+    process_minor_page_faults_total, process_major_page_faults_total = ru_minflt, ru_majflt
+    process_voluntary_context_switches_total, process_involuntary_context_switches_total
+        = ru_nvcsw, ru_nivcsw
+        all from getrusage(RUSAGE_SELF)
+
+    process_io_read_chars_total, process_io_write_chars_total = rchar, wchar
+    process_io_read_bytes_total, process_io_write_bytes_total = read_bytes, write_bytes
+        from /proc/self/io
+
+    process_schedstat_running_seconds_total, process_schedstat_waiting_seconds_total
+        summed over /proc/self/task/<tid>/schedstat of all threads. Threads that exited are still
+        counted with the values from the last collection before they exited.
+
+    process_cgroup_cpu_usage_seconds_total = usage_usec
+    process_cgroup_cpu_periods_total = nr_periods
+    process_cgroup_cpu_throttled_periods_total = nr_throttled
+    process_cgroup_cpu_throttled_seconds_total = throttled_usec
+        from cpu.stat of the cgroup v2 of the process
+
+    process_cgroup_memory_usage_bytes = memory.current
+    process_cgroup_memory_limit_bytes = memory.max (omitted if there is no limit)
+ */
+std::shared_ptr<cpprom::Collector> makeExtendedProcessMetricsCollector();
 }
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+
+#include "cpprom.hpp"
+
+namespace cpprom {
+/*
+
+    Pushes the metrics of a registry from a background thread, for processes that do not live
+    long enough to be scraped (e.g. batch jobs). They are pushed every interval seconds and once
+    more when the Pusher is destroyed, so the final values are not lost:
+
+        cpprom::Pusher pusher(registry, { "http://pushgateway:9091/metrics/job/batch" });
+
+    The connection is kept open between pushes. Only plain HTTP is supported (no TLS).
+    The registry is collected on the background thread, so with CPPROM_SINGLE_THREADED the
+    interval defaults to 0 and there is no background thread.
+    The push in the destructor blocks like push() does, i.e. for at most the configured timeout
+    (plus the time it takes to resolve the host name and collect the registry).
+
+    Protocol::Pushgateway PUTs the output of Registry::serialize() to the URL, which replaces all
+    metrics of the grouping key in the URL:
+    https://github.com/prometheus/pushgateway#url
+
+    Protocol::RemoteWrite POSTs a snappy-compressed WriteRequest with one sample per series to the
+    URL (e.g. http://prometheus:9090/api/v1/write). The snappy encoder only emits literals, which
+    is valid, but does not compress. Native histograms only send _count, _sum and +Inf.
+    https://prometheus.io/docs/specs/remote_write_spec/
+
+*/
+class Pusher {
+public:
+    enum class Protocol {
+        Pushgateway,
+        RemoteWrite,
+    };
+
+    struct Options {
+        std::string url;
+        Protocol protocol = Protocol::Pushgateway;
+        // If 0, only push() and the destructor push. Must be 0 with CPPROM_SINGLE_THREADED.
+#ifdef CPPROM_SINGLE_THREADED
+        double interval = 0.0;
+#else
+        double interval = 10.0;
+#endif
+        // Used for the Pushgateway
+        Format format = Format::Protobuf;
+        // For connecting, sending and receiving all together, i.e. for a whole push
+        double timeout = 5.0;
+    };
+
+    Pusher(const Registry& registry, Options options);
+    ~Pusher();
+
+    Pusher(const Pusher&) = delete;
+    Pusher& operator=(const Pusher&) = delete;
+
+    // Pushes right now (on the calling thread) and returns whether it succeeded
+    bool push();
+
+private:
+    void run();
+    bool send(std::string_view method, std::string_view contentType,
+        std::string_view contentEncoding, std::string_view body);
+    bool connect();
+    void disconnect();
+
+    const Registry& registry_;
+    Options options_;
+    std::string host_;
+    std::string port_;
+    std::string path_;
+
+    // Only one push at a time, so they can share the connection and the buffers
+    std::mutex pushMutex_;
+    int socket_ = -1;
+    std::chrono::steady_clock::time_point deadline_;
+    std::string body_;
+    std::string request_;
+
+    std::mutex stopMutex_;
+    std::condition_variable stopCondition_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+}
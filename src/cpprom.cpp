@@ -2,6 +2,16 @@
 
 #include <algorithm>
 #include <charconv>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <new>
+#include <system_error>
+#include <thread>
+
+#include "protobuf.hpp"
+#include "util.hpp"
 
 namespace {
 // https://github.com/boostorg/container_hash/blob/b3e424b6503709f4d86a91b78017ecce53747f02/include/boost/container_hash/hash.hpp#L340
@@ -34,35 +44,123 @@ namespace cpprom {
 
 double now()
 {
-    using Unit = std::chrono::seconds;
-    return std::chrono::duration_cast<std::chrono::duration<double, typename Unit::period>>(
-        std::chrono::high_resolution_clock::now().time_since_epoch())
+    return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch())
         .count();
 }
 
-namespace {
-    void atomicAdd(std::atomic<double>& value, double delta)
+namespace detail {
+#ifdef CPPROM_TSC_TIMER
+    namespace {
+        double calibrateTsc()
+        {
+            // Long enough that the time it takes to read both clocks does not matter much
+            using Clock = std::chrono::steady_clock;
+            const auto startTime = Clock::now();
+            const auto startTicks = __rdtsc();
+            while (Clock::now() - startTime < std::chrono::milliseconds(20)) {
+                // pass
+            }
+            const auto endTicks = __rdtsc();
+            const auto endTime = Clock::now();
+            return std::chrono::duration<double>(endTime - startTime).count()
+                / static_cast<double>(endTicks - startTicks);
+        }
+
+        // This is done when the program starts, so that the calibration does not delay (and show
+        // up in) the first durations that are measured
+        const double secondsPerTick = calibrateTsc();
+    }
+
+    double Timer::toSeconds(Ticks ticks)
     {
-        auto current = value.load();
-        while (!value.compare_exchange_weak(current, current + delta)) {
-            // pass
+        return static_cast<double>(ticks) * secondsPerTick;
+    }
+#else
+    double Timer::toSeconds(Ticks ticks)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::duration(ticks)).count();
+    }
+#endif
+}
+
+namespace detail {
+    std::pair<size_t, uint64_t> HotCold::startSnapshot()
+    {
+        // Incrementing the highest bit flips the hot index
+        const auto n = countAndHotIndex_.fetch_add(uint64_t(1) << 63, std::memory_order_seq_cst);
+        const auto count = n & ((uint64_t(1) << 63) - 1);
+        const auto coldIndex = static_cast<size_t>(n >> 63);
+        // Wait for the observations that started before the flip. This does not take long,
+        // because they are only a few atomic operations.
+        while (completed_[coldIndex].load(std::memory_order_acquire) != count) {
+            std::this_thread::yield();
         }
+        return { coldIndex, count };
+    }
+
+    void HotCold::finishSnapshot(size_t coldIndex, uint64_t count)
+    {
+        // The hot copy now contains everything, so it has to count the moved observations as well
+        completed_[coldIndex].store(0, std::memory_order_relaxed);
+        completed_[coldIndex ^ 1].fetch_add(count, std::memory_order_release);
+    }
+
+    size_t shardCount()
+    {
+        static const size_t count = [] {
+            // hardware_concurrency may return 0 if it is not known
+            const auto cores = std::max(std::thread::hardware_concurrency(), 1u);
+            size_t n = 1;
+            while (n < cores) {
+                n *= 2;
+            }
+            return n;
+        }();
+        return count;
+    }
+
+    size_t threadShardIndex()
+    {
+        // Hand out indices round-robin, so threads are spread evenly across the shards
+        static std::atomic<size_t> nextIndex { 0 };
+        thread_local const size_t index = nextIndex++;
+        return index;
     }
 }
 
-Counter::Counter(LabelValues labelValues, const Counter::Descriptor&)
+Counter::Counter(LabelValues labelValues, const Counter::Descriptor& descriptor,
+    detail::ChangeFlag* changeFlag)
     : labelValues_(std::move(labelValues))
+    , changeFlag_(changeFlag)
 {
+    if (descriptor.sharded) {
+        shards_ = std::make_unique<detail::Shard[]>(detail::shardCount());
+        shardMask_ = detail::shardCount() - 1;
+    }
 }
 
 void Counter::inc(double delta)
 {
     assert(delta > 0.0);
-    atomicAdd(value_, delta);
+    if (shards_) {
+        detail::atomicAdd(shards_[detail::threadShardIndex() & shardMask_].value, delta);
+    } else {
+        detail::atomicAdd(value_, delta);
+    }
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
 }
 
 double Counter::value() const
 {
+    if (shards_) {
+        double sum = 0.0;
+        for (size_t i = 0; i <= shardMask_; ++i) {
+            sum += shards_[i].value.load();
+        }
+        return sum;
+    }
     return value_.load();
 }
 
@@ -73,13 +171,13 @@ const LabelValues& Counter::labelValues() const
 
 Gauge::TimeHandle::TimeHandle(Gauge& gauge)
     : gauge(gauge)
-    , start(now())
+    , start(detail::Timer::now())
 {
 }
 
 Gauge::TimeHandle::~TimeHandle()
 {
-    gauge.set(now() - start);
+    gauge.set(detail::Timer::toSeconds(detail::Timer::now() - start));
 }
 
 Gauge::TrackInProgressHandle::TrackInProgressHandle(Gauge& gauge)
@@ -93,24 +191,32 @@ Gauge::TrackInProgressHandle::~TrackInProgressHandle()
     gauge.dec();
 }
 
-Gauge::Gauge(LabelValues labelValues, const Gauge::Descriptor&)
+Gauge::Gauge(
+    LabelValues labelValues, const Gauge::Descriptor&, detail::ChangeFlag* changeFlag)
     : labelValues_(std::move(labelValues))
+    , changeFlag_(changeFlag)
 {
 }
 
 void Gauge::inc(double delta)
 {
-    atomicAdd(value_, delta);
+    detail::atomicAdd(value_, delta);
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
 }
 
 void Gauge::dec(double delta)
 {
-    atomicAdd(value_, -delta);
+    inc(-delta);
 }
 
 void Gauge::set(double value)
 {
     value_.store(value);
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
 }
 
 void Gauge::setToCurrentTime()
@@ -138,6 +244,87 @@ const LabelValues& Gauge::labelValues() const
     return labelValues_;
 }
 
+IntCounter::IntCounter(
+    LabelValues labelValues, const IntCounter::Descriptor&, detail::ChangeFlag* changeFlag)
+    : labelValues_(std::move(labelValues))
+    , changeFlag_(changeFlag)
+{
+}
+
+void IntCounter::inc(uint64_t delta)
+{
+    // seq_cst (on x86 this is the same instruction as relaxed), see detail::ChangeFlag::set()
+    value_.fetch_add(delta);
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
+}
+
+uint64_t IntCounter::value() const
+{
+    return value_.load();
+}
+
+const LabelValues& IntCounter::labelValues() const
+{
+    return labelValues_;
+}
+
+IntGauge::TrackInProgressHandle::TrackInProgressHandle(IntGauge& gauge)
+    : gauge(gauge)
+{
+    gauge.inc();
+}
+
+IntGauge::TrackInProgressHandle::~TrackInProgressHandle()
+{
+    gauge.dec();
+}
+
+IntGauge::IntGauge(
+    LabelValues labelValues, const IntGauge::Descriptor&, detail::ChangeFlag* changeFlag)
+    : labelValues_(std::move(labelValues))
+    , changeFlag_(changeFlag)
+{
+}
+
+void IntGauge::inc(int64_t delta)
+{
+    // seq_cst, see IntCounter::inc()
+    value_.fetch_add(delta);
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
+}
+
+void IntGauge::dec(int64_t delta)
+{
+    inc(-delta);
+}
+
+void IntGauge::set(int64_t value)
+{
+    value_.store(value);
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
+}
+
+IntGauge::TrackInProgressHandle IntGauge::trackInProgress()
+{
+    return TrackInProgressHandle(*this);
+}
+
+int64_t IntGauge::value() const
+{
+    return value_.load();
+}
+
+const LabelValues& IntGauge::labelValues() const
+{
+    return labelValues_;
+}
+
 std::vector<double> Histogram::defaultBuckets()
 {
     return std::vector<double> { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0 };
@@ -165,42 +352,48 @@ std::vector<double> Histogram::exponentialBuckets(double start, double factor, u
 
 Histogram::TimeHandle::TimeHandle(Histogram& histogram)
     : histogram(histogram)
-    , start(now())
+    , start(detail::Timer::now())
 {
 }
 
 Histogram::TimeHandle::~TimeHandle()
 {
-    histogram.observe(now() - start);
+    histogram.observe(detail::Timer::toSeconds(detail::Timer::now() - start));
 }
 
-Histogram::Histogram(LabelValues labelValues, const Histogram::Descriptor& descriptor)
+Histogram::Histogram(LabelValues labelValues, const Histogram::Descriptor& descriptor,
+    detail::ChangeFlag* changeFlag)
     : labelValues_(std::move(labelValues))
-    , buckets_(descriptor.bucketBounds.size() + 1) // +1 for +Inf bucket
+    , upperBounds_(descriptor.bucketBounds)
+    , changeFlag_(changeFlag)
 {
-    assert(buckets_.size() > 1);
-    // This code could be much clearer/simpler if I could use buckets_.push_back, but sadly that
-    // requires that Bucket is movable, which it is not, because of std::atomic. Therefore I
-    // need to specify the size in the constructor already.
-    size_t i = 0;
-    for (const auto& boundary : descriptor.bucketBounds) {
-        buckets_[i].upperBound = static_cast<double>(boundary);
-        if (i > 0) {
-            assert(buckets_[i - 1].upperBound < static_cast<double>(boundary));
-        }
-        i++;
+    assert(!upperBounds_.empty());
+    assert(std::is_sorted(upperBounds_.begin(), upperBounds_.end()));
+    assert(std::adjacent_find(upperBounds_.begin(), upperBounds_.end()) == upperBounds_.end());
+    upperBounds_.push_back(std::numeric_limits<double>::infinity());
+    for (auto& counts : counts_) {
+        // Value-initialized, i.e. 0
+        counts.buckets = std::make_unique<std::atomic<uint64_t>[]>(upperBounds_.size());
     }
-    buckets_.back().upperBound = std::numeric_limits<double>::infinity();
 }
 
 void Histogram::observe(double value)
 {
-    for (auto& bucket : buckets_) {
-        if (value <= bucket.upperBound) {
-            ++bucket.count;
-        }
+    // The buckets are sorted, so we can binary search for the first one that fits and only
+    // increment that one. The last one is +Inf, so only NaN will not find a bucket and we count
+    // it in +Inf, like the other client libraries do.
+    const auto it = std::partition_point(upperBounds_.begin(), upperBounds_.end(),
+        [value](double upperBound) { return !(value <= upperBound); });
+    const auto bucket = std::min(
+        static_cast<size_t>(it - upperBounds_.begin()), upperBounds_.size() - 1);
+
+    const auto hot = hotCold_.begin();
+    counts_[hot].buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    detail::atomicAdd(counts_[hot].sum, value);
+    hotCold_.end(hot);
+    if (changeFlag_) {
+        changeFlag_->set();
     }
-    atomicAdd(sum_, value);
 }
 
 Histogram::TimeHandle Histogram::time()
@@ -208,282 +401,1799 @@ Histogram::TimeHandle Histogram::time()
     return Histogram::TimeHandle(*this);
 }
 
-const std::vector<Histogram::Bucket>& Histogram::buckets() const
+const std::vector<double>& Histogram::upperBounds() const
+{
+    return upperBounds_;
+}
+
+Histogram::Snapshot Histogram::snapshot() const
 {
-    return buckets_;
+    const auto lock = hotCold_.lock();
+    const auto [coldIndex, count] = hotCold_.startSnapshot();
+    auto& cold = counts_[coldIndex];
+    auto& hot = counts_[coldIndex ^ 1];
+
+    Snapshot snapshot { std::vector<uint64_t>(upperBounds_.size()), cold.sum.load(), count };
+    for (size_t i = 0; i < upperBounds_.size(); ++i) {
+        snapshot.bucketCounts[i] = cold.buckets[i].exchange(0, std::memory_order_relaxed);
+        hot.buckets[i].fetch_add(snapshot.bucketCounts[i], std::memory_order_relaxed);
+    }
+    cold.sum.store(0.0);
+    detail::atomicAdd(hot.sum, snapshot.sum);
+    hotCold_.finishSnapshot(coldIndex, count);
+    return snapshot;
 }
 
 double Histogram::sum() const
 {
-    return sum_;
+    return snapshot().sum;
 }
 
 uint64_t Histogram::count() const
 {
-    return buckets_.back().count.load();
+    return snapshot().count;
 }
 
-namespace detail {
-    // https://prometheus.io/docs/concepts/data_model/#metric-names-and-labels
-
-    bool isValidMetricName(std::string_view str)
-    {
-        // regex: [a-zA-Z_:][a-zA-Z0-9_:]*
-        // I should probably use LUTs to check the characcters
-        if (str.empty()) {
-            return false;
-        }
-        // [a-zA-Z_:]
-        if (!isAlpha(str[0]) && str[0] != '_' && str[0] != ':') {
-            return false;
-        }
-        // [a-zA-Z0-9_:]*
-        for (const auto ch : str.substr(1)) {
-            if (!isAlpha(ch) && !isDigit(ch) && ch != '_' && ch != ':') {
-                return false;
-            }
-        }
-        return true;
-    }
-
-    bool isValidLabelName(std::string_view str)
-    {
-        // regex: [a-zA-Z_][a-zA-Z0-9_]*
-        if (str.empty()) {
-            return true;
-        }
-        if (str.size() >= 2 && str[0] == '_' && str[1] == '_') {
-            // reserved for internal use
-            return false;
-        }
-        // [a-zA-Z_]
-        if (!isAlpha(str[0]) && str[0] != '_') {
-            return false;
-        }
-        // [a-zA-Z0-9_]*
-        for (const auto ch : str.substr(1)) {
-            if (!isAlpha(ch) && !isDigit(ch) && ch != '_') {
-                return false;
-            }
-        }
-        return true;
-    }
-
-    size_t LabelValuesHash::operator()(const LabelValues& labelValues) const
-    {
-        size_t seed = 0;
-        for (const auto& v : labelValues) {
-            hashCombine(seed, std::hash<std::string> {}(v));
-        }
-        return seed;
-    }
+const LabelValues& Histogram::labelValues() const
+{
+    return labelValues_;
 }
 
-namespace {
-    std::string toString(double num)
-    {
-        if (num == std::numeric_limits<double>::infinity()) {
-            return "+Inf";
-        }
-
-        char buf[32]; // 15 significant digits plus decimal point
-        const auto res = std::to_chars(buf, buf + sizeof(buf), num, std::chars_format::fixed);
-        assert(res.ec == std::errc());
-        return std::string(static_cast<const char*>(buf), const_cast<const char*>(res.ptr));
-    }
+NativeHistogram::TimeHandle::TimeHandle(NativeHistogram& histogram)
+    : histogram(histogram)
+    , start(detail::Timer::now())
+{
 }
 
-std::string serialize(const std::vector<Collector::Family>& families)
+NativeHistogram::TimeHandle::~TimeHandle()
 {
-    // https://prometheus.io/docs/instrumenting/exposition_formats/
-    // https://github.com/OpenObservability/OpenMetrics/blob/main/specification/OpenMetrics.md
-    std::string str;
-    str.reserve(4096);
-    for (const auto& family : families) {
-        if (family.help.size() > 0) {
-            str.append("# HELP ");
-            str.append(family.name);
-            str.append(" ");
-            str.append(family.help);
-            str.append("\n");
-        }
-        str.append("# TYPE ");
-        str.append(family.name);
-        str.append(" ");
-        str.append(family.type);
-        str.append("\n");
-
-        for (const auto& sample : family.samples) {
-            str.append(sample.name);
-
-            assert(sample.labelNames.size() == sample.labelValues.size());
-            if (sample.labelValues.size() > 0) {
-                str.append("{");
-                for (size_t i = 0; i < sample.labelValues.size(); ++i) {
-                    if (i > 0) {
-                        str.append(",");
-                    }
-                    str.append(sample.labelNames[i]);
-                    str.append("=\"");
-                    // TODO: Worry about escaping this string
-                    str.append(sample.labelValues[i]);
-                    str.append("\"");
-                }
-                str.append("}");
-            }
+    histogram.observe(detail::Timer::toSeconds(detail::Timer::now() - start));
+}
 
-            str.append(" ");
-            str.append(toString(sample.value));
-            str.append("\n");
-        }
-        str.append("\n");
+NativeHistogram::Buckets::Chunk::Chunk()
+{
+    for (auto& count : counts) {
+        count.store(0, std::memory_order_relaxed);
     }
-    return str;
 }
 
-template <>
-std::vector<Collector::Family> MetricFamily<Counter>::collect() const
+NativeHistogram::Buckets::Buckets(int32_t minIndex, int32_t maxIndex)
+    : minIndex_(minIndex)
+    , maxIndex_(maxIndex)
+    , chunkCount_((maxIndex - minIndex) / ChunkSize + 1)
 {
-    std::vector<Collector::Sample> samples;
-    for (const auto& [labelValues, metric] : metrics_) {
-        samples.push_back(Collector::Sample { name_, metric->value(), labelNames_, labelValues });
+    chunks_ = std::make_unique<std::atomic<Chunk*>[]>(chunkCount_);
+    for (size_t i = 0; i < chunkCount_; ++i) {
+        chunks_[i].store(nullptr, std::memory_order_relaxed);
     }
-
-    return std::vector<Collector::Family> {
-        Collector::Family { name_, help_, "counter", std::move(samples) },
-    };
 }
 
-template <>
-std::vector<Collector::Family> MetricFamily<Gauge>::collect() const
+NativeHistogram::Buckets::~Buckets()
 {
-    std::vector<Collector::Sample> samples;
-    for (const auto& [labelValues, metric] : metrics_) {
-        samples.push_back(Collector::Sample { name_, metric->value(), labelNames_, labelValues });
+    for (size_t i = 0; i < chunkCount_; ++i) {
+        delete chunks_[i].load();
     }
-
-    return std::vector<Collector::Family> {
-        Collector::Family { name_, help_, "gauge", std::move(samples) },
-    };
 }
 
-template <>
-std::vector<Collector::Family> MetricFamily<Histogram>::collect() const
+void NativeHistogram::Buckets::add(int32_t index, uint64_t count)
 {
-    for (const auto& labelName : labelNames_) {
-        assert(labelName != "le");
+    const auto offset = static_cast<size_t>(std::clamp(index, minIndex_, maxIndex_) - minIndex_);
+    auto& chunkPtr = chunks_[offset / ChunkSize];
+    auto chunk = chunkPtr.load(std::memory_order_acquire);
+    if (!chunk) {
+        // If another thread was faster, we use its chunk instead
+        auto newChunk = std::make_unique<Chunk>();
+        if (chunkPtr.compare_exchange_strong(chunk, newChunk.get(), std::memory_order_acq_rel)) {
+            chunk = newChunk.release();
+        }
     }
+    chunk->counts[offset % ChunkSize].fetch_add(count, std::memory_order_relaxed);
+}
 
-    std::vector<Collector::Sample> samples;
-    std::lock_guard g(mutex_);
-    for (const auto& [labelValues, metric] : metrics_) {
-        auto bucketLabelNames = labelNames_;
-        bucketLabelNames.push_back("le");
-
-        auto bucketLabelValues = labelValues;
-        bucketLabelValues.push_back("");
-
-        const auto bucketName = name_ + "_bucket";
-        for (const auto& bucket : metric->buckets()) {
-            bucketLabelValues.back() = toString(bucket.upperBound);
-            samples.push_back(Collector::Sample { bucketName,
-                static_cast<double>(bucket.count.load()), bucketLabelNames, bucketLabelValues });
+void NativeHistogram::Buckets::moveTo(
+    Buckets& other, std::vector<std::pair<int32_t, uint64_t>>& buckets)
+{
+    assert(minIndex_ == other.minIndex_ && maxIndex_ == other.maxIndex_);
+    for (size_t c = 0; c < chunkCount_; ++c) {
+        const auto chunk = chunks_[c].load(std::memory_order_acquire);
+        if (!chunk) {
+            continue;
         }
+        for (size_t i = 0; i < ChunkSize; ++i) {
+            const auto count = chunk->counts[i].exchange(0, std::memory_order_relaxed);
+            if (count > 0) {
+                const auto index = static_cast<int32_t>(minIndex_ + c * ChunkSize + i);
+                buckets.emplace_back(index, count);
+                other.add(index, count);
+            }
+        }
+    }
+}
 
-        samples.push_back(
-            Collector::Sample { name_ + "_sum", metric->sum(), labelNames_, labelValues });
-
-        samples.push_back(Collector::Sample { name_ + "_count",
-            static_cast<double>(metric->buckets().back().count.load()), labelNames_, labelValues });
+namespace {
+    int32_t maxBucketIndex(int8_t schema)
+    {
+        return NativeHistogram::bucketIndex(std::numeric_limits<double>::max(), schema);
     }
 
-    return std::vector<Collector::Family> {
-        Collector::Family { name_, help_, "histogram", std::move(samples) },
-    };
+    int32_t minBucketIndex(int8_t schema, double zeroThreshold)
+    {
+        // Everything below the zero threshold goes into the zero bucket
+        return NativeHistogram::bucketIndex(
+            std::max(zeroThreshold, std::numeric_limits<double>::denorm_min()), schema);
+    }
 }
 
-std::shared_ptr<MetricFamily<Counter>> makeCounter(
-    std::string name, std::vector<std::string> labelNames, std::string help)
+NativeHistogram::Counts::Counts(int32_t minIndex, int32_t maxIndex)
+    : positive(minIndex, maxIndex)
+    , negative(minIndex, maxIndex)
 {
-    return std::make_shared<MetricFamily<Counter>>(
-        std::move(name), std::move(labelNames), std::move(help));
 }
 
-std::shared_ptr<MetricFamily<Gauge>> makeGauge(
-    std::string name, std::vector<std::string> labelNames, std::string help)
+NativeHistogram::NativeHistogram(LabelValues labelValues,
+    const NativeHistogram::Descriptor& descriptor, detail::ChangeFlag* changeFlag)
+    : labelValues_(std::move(labelValues))
+    , schema_(descriptor.schema)
+    , zeroThreshold_(descriptor.zeroThreshold)
+    , counts_ { Counts(minBucketIndex(schema_, zeroThreshold_), maxBucketIndex(schema_)),
+        Counts(minBucketIndex(schema_, zeroThreshold_), maxBucketIndex(schema_)) }
+    , changeFlag_(changeFlag)
 {
-    return std::make_shared<MetricFamily<Gauge>>(
-        std::move(name), std::move(labelNames), std::move(help));
+    assert(schema_ >= -4 && schema_ <= 8);
+    assert(zeroThreshold_ >= 0.0);
 }
 
-std::shared_ptr<MetricFamily<Histogram>> makeHistogram(std::string name,
-    std::vector<std::string> labelNames, std::vector<double> bucketBounds, std::string help)
+int32_t NativeHistogram::bucketIndex(double value, int8_t schema)
 {
-    return std::make_shared<MetricFamily<Histogram>>(std::move(name), std::move(labelNames),
-        std::move(help), Histogram::Descriptor { std::move(bucketBounds) });
+    value = std::abs(value);
+    if (std::isinf(value)) {
+        // Goes into the last bucket, which also contains DBL_MAX
+        value = std::numeric_limits<double>::max();
+    }
+    // value = frac * 2^exp with frac in [0.5, 1)
+    int exp = 0;
+    const auto frac = std::frexp(value, &exp);
+    if (schema > 0) {
+        // The buckets subdivide each power of two, so only frac needs a logarithm.
+        // log2(0.5) is exact, so powers of two always land in the right bucket.
+        const auto bucketsPerPower = 1 << schema;
+        return exp * bucketsPerPower
+            + static_cast<int32_t>(std::ceil(std::log2(frac) * bucketsPerPower));
+    }
+    // The boundaries are powers of two, so the exponent is enough
+    const auto index = frac == 0.5 ? exp - 1 : exp;
+    const auto shift = -schema;
+    return (index + (1 << shift) - 1) >> shift;
 }
 
-Registry& Registry::getDefault()
+void NativeHistogram::observe(double value)
 {
-    static Registry reg;
-    return reg;
+    const auto hot = hotCold_.begin();
+    auto& counts = counts_[hot];
+    // Like in the Go client library, NaN is only counted in _count (and makes _sum NaN)
+    if (std::abs(value) <= zeroThreshold_) {
+        counts.zeroCount.fetch_add(1, std::memory_order_relaxed);
+    } else if (value > 0.0) {
+        counts.positive.add(bucketIndex(value, schema_), 1);
+    } else if (value < 0.0) {
+        counts.negative.add(bucketIndex(value, schema_), 1);
+    }
+    detail::atomicAdd(counts.sum, value);
+    hotCold_.end(hot);
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
 }
 
-MetricFamily<Counter>& Registry::counter(
-    std::string name, std::vector<std::string> labelNames, std::string help)
+NativeHistogram::TimeHandle NativeHistogram::time()
 {
-    auto f = makeCounter(std::move(name), std::move(labelNames), std::move(help));
-    registerCollector(f);
-    return *f;
+    return NativeHistogram::TimeHandle(*this);
 }
 
-Counter& Registry::counter(std::string name, std::string help)
+NativeHistogram::Snapshot NativeHistogram::snapshot() const
 {
-    return counter(std::move(name), {}, std::move(help)).labels();
+    const auto lock = hotCold_.lock();
+    const auto [coldIndex, count] = hotCold_.startSnapshot();
+    auto& cold = counts_[coldIndex];
+    auto& hot = counts_[coldIndex ^ 1];
+
+    Snapshot snapshot { schema_, zeroThreshold_, cold.zeroCount.exchange(0), count,
+        cold.sum.exchange(0.0), {}, {} };
+    hot.zeroCount += snapshot.zeroCount;
+    detail::atomicAdd(hot.sum, snapshot.sum);
+    cold.positive.moveTo(hot.positive, snapshot.positiveBuckets);
+    cold.negative.moveTo(hot.negative, snapshot.negativeBuckets);
+    hotCold_.finishSnapshot(coldIndex, count);
+    return snapshot;
 }
 
-MetricFamily<Gauge>& Registry::gauge(
-    std::string name, std::vector<std::string> labelNames, std::string help)
+double NativeHistogram::sum() const
 {
-    auto f = makeGauge(std::move(name), std::move(labelNames), std::move(help));
-    registerCollector(f);
-    return *f;
+    return snapshot().sum;
 }
 
-Gauge& Registry::gauge(std::string name, std::string help)
+uint64_t NativeHistogram::count() const
 {
-    return gauge(std::move(name), {}, std::move(help)).labels();
+    return snapshot().count;
 }
 
-MetricFamily<Histogram>& Registry::histogram(std::string name, std::vector<std::string> labelNames,
-    std::vector<double> bucketBounds, std::string help)
+const LabelValues& NativeHistogram::labelValues() const
 {
-    auto f = makeHistogram(
-        std::move(name), std::move(labelNames), std::move(bucketBounds), std::move(help));
-    registerCollector(f);
-    return *f;
+    return labelValues_;
 }
 
-Histogram& Registry::histogram(std::string name, std::vector<double> bucketBounds, std::string help)
-{
-    return histogram(std::move(name), {}, std::move(bucketBounds), std::move(help)).labels();
-}
+namespace {
+    // https://arxiv.org/abs/1908.10693
+    // Bucket i contains the values in (gamma^(i-1), gamma^i] and the value of a bucket is chosen so
+    // that the relative error for every value in it is at most relativeAccuracy.
+    class DDSketch {
+    public:
+        DDSketch(double relativeAccuracy, size_t maxBuckets)
+            : gamma_((1.0 + relativeAccuracy) / (1.0 - relativeAccuracy))
+            , logGamma_(std::log(gamma_))
+            , maxBuckets_(maxBuckets)
+        {
+            assert(relativeAccuracy > 0.0 && relativeAccuracy < 1.0);
+            assert(maxBuckets > 0);
+        }
 
-Registry& Registry::registerCollector(std::shared_ptr<Collector> collector)
-{
-    std::lock_guard g(mutex_);
-    assert(std::find(collectors_.begin(), collectors_.end(), collector) == collectors_.end());
-    collectors_.push_back(collector);
-    return *this;
-}
+        void add(double value)
+        {
+            if (std::isnan(value)) {
+                return;
+            }
+            const auto abs = std::abs(value);
+            if (abs < minValue) {
+                zeroCount_++;
+            } else {
+                const auto index = static_cast<int32_t>(std::ceil(std::log(abs) / logGamma_));
+                (value > 0.0 ? positive_ : negative_).add(index, 1, maxBuckets_);
+            }
+        }
 
-std::string Registry::serialize() const
-{
-    std::string str;
-    std::lock_guard g(mutex_);
-    for (const auto& collector : collectors_) {
-        str.append(cpprom::serialize(collector->collect()));
-    }
-    return str;
+        void merge(const DDSketch& other)
+        {
+            assert(gamma_ == other.gamma_);
+            positive_.merge(other.positive_, maxBuckets_);
+            negative_.merge(other.negative_, maxBuckets_);
+            zeroCount_ += other.zeroCount_;
+        }
+
+        void clear()
+        {
+            positive_.clear();
+            negative_.clear();
+            zeroCount_ = 0;
+        }
+
+        uint64_t count() const { return positive_.count() + negative_.count() + zeroCount_; }
+
+        double quantile(double q) const
+        {
+            const auto total = count();
+            if (total == 0) {
+                return std::numeric_limits<double>::quiet_NaN();
+            }
+            // The rank of the value we are looking for, counted from 0
+            const auto rank = static_cast<uint64_t>(q * static_cast<double>(total - 1));
+            // The negative values are ordered from the biggest absolute value to the smallest
+            const auto negativeCount = negative_.count();
+            if (rank < negativeCount) {
+                return -value(negative_.indexAtRank(negativeCount - 1 - rank));
+            }
+            if (rank < negativeCount + zeroCount_) {
+                return 0.0;
+            }
+            return value(positive_.indexAtRank(rank - negativeCount - zeroCount_));
+        }
+
+    private:
+        // Counts of consecutive bucket indices
+        class Store {
+        public:
+            void add(int32_t index, uint64_t count, size_t maxBuckets)
+            {
+                if (counts_.empty()) {
+                    offset_ = index;
+                    counts_.push_back(0);
+                } else if (index < offset_) {
+                    if (counts_.size() >= maxBuckets) {
+                        // Too many buckets already, so this goes into the lowest one
+                        index = offset_;
+                    } else {
+                        // Grow downwards, but never beyond maxBuckets
+                        const auto grow = std::min(static_cast<size_t>(offset_ - index),
+                            maxBuckets - counts_.size());
+                        counts_.insert(counts_.begin(), grow, 0);
+                        offset_ -= static_cast<int32_t>(grow);
+                        index = std::max(index, offset_);
+                    }
+                } else if (index >= offset_ + static_cast<int32_t>(counts_.size())) {
+                    counts_.resize(static_cast<size_t>(index - offset_) + 1, 0);
+                    if (counts_.size() > maxBuckets) {
+                        collapse(maxBuckets);
+                    }
+                }
+                counts_[static_cast<size_t>(index - offset_)] += count;
+                count_ += count;
+            }
+
+            void merge(const Store& other, size_t maxBuckets)
+            {
+                for (size_t i = 0; i < other.counts_.size(); ++i) {
+                    if (other.counts_[i] > 0) {
+                        add(other.offset_ + static_cast<int32_t>(i), other.counts_[i], maxBuckets);
+                    }
+                }
+            }
+
+            void clear()
+            {
+                counts_.clear();
+                count_ = 0;
+            }
+
+            uint64_t count() const { return count_; }
+
+            int32_t indexAtRank(uint64_t rank) const
+            {
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i < counts_.size(); ++i) {
+                    cumulative += counts_[i];
+                    if (cumulative > rank) {
+                        return offset_ + static_cast<int32_t>(i);
+                    }
+                }
+                assert(false && "rank out of range");
+                return offset_ + static_cast<int32_t>(counts_.size()) - 1;
+            }
+
+        private:
+            // Merges the lowest buckets, so that there are only maxBuckets left
+            void collapse(size_t maxBuckets)
+            {
+                const auto excess = counts_.size() - maxBuckets;
+                uint64_t lowest = 0;
+                for (size_t i = 0; i <= excess; ++i) {
+                    lowest += counts_[i];
+                }
+                counts_.erase(counts_.begin(), counts_.begin() + static_cast<ptrdiff_t>(excess));
+                counts_.front() = lowest;
+                offset_ += static_cast<int32_t>(excess);
+            }
+
+            std::vector<uint64_t> counts_;
+            int32_t offset_ = 0;
+            uint64_t count_ = 0;
+        };
+
+        // Values smaller than this are counted as 0, so the indices (and the number of buckets)
+        // stay in a reasonable range.
+        static constexpr double minValue = 1e-9;
+
+        double value(int32_t index) const
+        {
+            // The relative error of this is the same for both ends of the bucket
+            return 2.0 * std::pow(gamma_, index) / (gamma_ + 1.0);
+        }
+
+        double gamma_;
+        double logGamma_;
+        size_t maxBuckets_;
+        Store positive_;
+        Store negative_;
+        uint64_t zeroCount_ = 0;
+    };
+}
+
+struct alignas(64) Summary::Shard {
+    struct Window {
+        DDSketch sketch;
+        // The window covers [epoch * windowLength, (epoch + 1) * windowLength) after start_
+        int64_t epoch = -1;
+    };
+
+    // The methods of metrics are always thread-safe, even with CPPROM_SINGLE_THREADED
+    mutable std::mutex mutex;
+    std::vector<Window> windows;
+    double sum = 0.0;
+    uint64_t count = 0;
+};
+
+Summary::TimeHandle::TimeHandle(Summary& summary)
+    : summary(summary)
+    , start(detail::Timer::now())
+{
+}
+
+Summary::TimeHandle::~TimeHandle()
+{
+    summary.observe(detail::Timer::toSeconds(detail::Timer::now() - start));
+}
+
+Summary::Summary(
+    LabelValues labelValues, const Summary::Descriptor& descriptor, detail::ChangeFlag* changeFlag)
+    : labelValues_(std::move(labelValues))
+    , descriptor_(descriptor)
+    , start_(std::chrono::steady_clock::now())
+    , shards_(std::make_unique<Shard[]>(detail::shardCount()))
+    , shardMask_(detail::shardCount() - 1)
+    , changeFlag_(changeFlag)
+{
+    assert(descriptor_.maxAge > 0.0);
+    assert(descriptor_.ageBuckets > 0);
+    for (const auto q : descriptor_.quantiles) {
+        assert(q >= 0.0 && q <= 1.0);
+        (void)q;
+    }
+    for (size_t i = 0; i <= shardMask_; ++i) {
+        shards_[i].windows.assign(descriptor_.ageBuckets,
+            Shard::Window {
+                DDSketch(descriptor_.relativeAccuracy, descriptor_.maxSketchBuckets), -1 });
+    }
+}
+
+Summary::~Summary() = default;
+
+namespace {
+    int64_t currentEpoch(std::chrono::steady_clock::time_point start, const Summary::Descriptor& d)
+    {
+        const auto age = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+        return static_cast<int64_t>(age.count() / (d.maxAge / static_cast<double>(d.ageBuckets)));
+    }
+}
+
+void Summary::observe(double value)
+{
+    const auto epoch = currentEpoch(start_, descriptor_);
+    auto& shard = shards_[detail::threadShardIndex() & shardMask_];
+    {
+        std::lock_guard g(shard.mutex);
+        // The windows are reused round-robin, so an old window is cleared when it is needed again
+        auto& window = shard.windows[static_cast<size_t>(epoch) % shard.windows.size()];
+        if (window.epoch != epoch) {
+            window.sketch.clear();
+            window.epoch = epoch;
+        }
+        window.sketch.add(value);
+        shard.sum += value;
+        shard.count++;
+    }
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
+}
+
+Summary::TimeHandle Summary::time()
+{
+    return Summary::TimeHandle(*this);
+}
+
+std::vector<Summary::Quantile> Summary::quantiles() const
+{
+    const auto epoch = currentEpoch(start_, descriptor_);
+    const auto ageBuckets = static_cast<int64_t>(descriptor_.ageBuckets);
+    DDSketch merged(descriptor_.relativeAccuracy, descriptor_.maxSketchBuckets);
+    for (size_t i = 0; i <= shardMask_; ++i) {
+        std::lock_guard g(shards_[i].mutex);
+        for (const auto& window : shards_[i].windows) {
+            if (window.epoch > epoch - ageBuckets) {
+                merged.merge(window.sketch);
+            }
+        }
+    }
+
+    std::vector<Quantile> quantiles;
+    quantiles.reserve(descriptor_.quantiles.size());
+    for (const auto q : descriptor_.quantiles) {
+        quantiles.push_back(Quantile { q, merged.quantile(q) });
+    }
+    return quantiles;
+}
+
+double Summary::sum() const
+{
+    double sum = 0.0;
+    for (size_t i = 0; i <= shardMask_; ++i) {
+        std::lock_guard g(shards_[i].mutex);
+        sum += shards_[i].sum;
+    }
+    return sum;
+}
+
+uint64_t Summary::count() const
+{
+    uint64_t count = 0;
+    for (size_t i = 0; i <= shardMask_; ++i) {
+        std::lock_guard g(shards_[i].mutex);
+        count += shards_[i].count;
+    }
+    return count;
+}
+
+const LabelValues& Summary::labelValues() const
+{
+    return labelValues_;
+}
+
+namespace detail {
+    // https://prometheus.io/docs/concepts/data_model/#metric-names-and-labels
+
+    bool isValidMetricName(std::string_view str)
+    {
+        // regex: [a-zA-Z_:][a-zA-Z0-9_:]*
+        // I should probably use LUTs to check the characcters
+        if (str.empty()) {
+            return false;
+        }
+        // [a-zA-Z_:]
+        if (!isAlpha(str[0]) && str[0] != '_' && str[0] != ':') {
+            return false;
+        }
+        // [a-zA-Z0-9_:]*
+        for (const auto ch : str.substr(1)) {
+            if (!isAlpha(ch) && !isDigit(ch) && ch != '_' && ch != ':') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool isValidLabelName(std::string_view str)
+    {
+        // regex: [a-zA-Z_][a-zA-Z0-9_]*
+        if (str.empty()) {
+            return true;
+        }
+        if (str.size() >= 2 && str[0] == '_' && str[1] == '_') {
+            // reserved for internal use
+            return false;
+        }
+        // [a-zA-Z_]
+        if (!isAlpha(str[0]) && str[0] != '_') {
+            return false;
+        }
+        // [a-zA-Z0-9_]*
+        for (const auto ch : str.substr(1)) {
+            if (!isAlpha(ch) && !isDigit(ch) && ch != '_') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+#ifdef CPPROM_INTERN_LABELS
+    const InternedString* intern(std::string_view str)
+    {
+        // Function-local statics, so this may be used during static initialization
+        static CPPROM_MUTEX mutex;
+        // std::deque does not move its elements, so the keys can point into them
+        static std::deque<InternedString> entries;
+        static std::unordered_map<std::string_view, const InternedString*> pool;
+
+        const auto hash = std::hash<std::string_view> {}(str);
+        std::lock_guard g(mutex);
+        const auto it = pool.find(str);
+        if (it != pool.end()) {
+            return it->second;
+        }
+        const auto& entry = entries.emplace_back(InternedString { std::string(str), hash });
+        pool.emplace(entry.value, &entry);
+        return &entry;
+    }
+
+    size_t LabelValuesHash::operator()(const LabelValues& labelValues) const
+    {
+        // The hashes of the interned strings are already known
+        size_t seed = 0;
+        for (size_t i = 0; i < labelValues.size(); ++i) {
+            hashCombine(seed, labelValues.interned(i)->hash);
+        }
+        return seed;
+    }
+#else
+    size_t LabelValuesHash::operator()(const LabelValues& labelValues) const
+    {
+        size_t seed = 0;
+        for (const auto& v : labelValues) {
+            hashCombine(seed, std::hash<std::string_view> {}(v));
+        }
+        return seed;
+    }
+#endif
+
+    size_t LabelValuesHash::operator()(const std::string_view* labelValues, size_t count) const
+    {
+        size_t seed = 0;
+        for (size_t i = 0; i < count; ++i) {
+            hashCombine(seed, std::hash<std::string_view> {}(labelValues[i]));
+        }
+        return seed;
+    }
+
+    bool labelValuesEqual(
+        const LabelValues& labelValues, const std::string_view* other, size_t count)
+    {
+        if (labelValues.size() != count) {
+            return false;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (labelValues[i] != other[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string renderLabels(
+        const std::vector<std::string>& labelNames, const LabelValues& labelValues)
+    {
+        assert(labelNames.size() == labelValues.size());
+        std::string str;
+        for (size_t i = 0; i < labelValues.size(); ++i) {
+            if (i > 0) {
+                str.append(",");
+            }
+            str.append(labelNames[i]);
+            str.append("=\"");
+            // TODO: Worry about escaping this string
+            str.append(labelValues[i]);
+            str.append("\"");
+        }
+        return str;
+    }
+}
+
+namespace detail {
+    Slab::~Slab()
+    {
+        for (const auto& chunk : chunks_) {
+            ::operator delete(chunk.memory, std::align_val_t(alignment_));
+        }
+    }
+
+    void* Slab::allocate(size_t size, size_t alignment)
+    {
+        std::lock_guard g(mutex_);
+        if (blockSize_ == 0) {
+            alignment_ = alignment;
+            // Round up to a multiple of the alignment, so every block is aligned
+            blockSize_ = (size + alignment - 1) / alignment * alignment;
+        }
+        assert(size <= blockSize_ && alignment == alignment_);
+
+        if (!freeBlocks_.empty()) {
+            const auto block = freeBlocks_.back();
+            freeBlocks_.pop_back();
+            return block;
+        }
+
+        if (chunks_.empty() || usedInLastChunk_ == chunks_.back().blockCount) {
+            // Start small, because many families only have a few children
+            const auto blockCount
+                = chunks_.empty() ? 8 : std::min(chunks_.back().blockCount * 2, size_t(4096));
+            const auto memory
+                = ::operator new(blockCount * blockSize_, std::align_val_t(alignment_));
+            chunks_.push_back(Chunk { memory, blockCount });
+            usedInLastChunk_ = 0;
+        }
+        auto memory = static_cast<char*>(chunks_.back().memory);
+        return memory + blockSize_ * usedInLastChunk_++;
+    }
+
+    void Slab::deallocate(void* block)
+    {
+        std::lock_guard g(mutex_);
+        freeBlocks_.push_back(block);
+    }
+}
+
+namespace {
+    // https://prometheus.io/docs/instrumenting/exposition_formats/
+    // https://github.com/OpenObservability/OpenMetrics/blob/main/specification/OpenMetrics.md
+    class TextSerializer : public SampleVisitor {
+    public:
+        TextSerializer(Sink& sink)
+            : sink_(sink)
+        {
+        }
+
+        // Terminates the last family
+        ~TextSerializer()
+        {
+            if (inFamily_) {
+                sink_.write("\n");
+            }
+        }
+
+        void family(std::string_view name, std::string_view help, std::string_view type) override
+        {
+            if (inFamily_) {
+                sink_.write("\n");
+            }
+            inFamily_ = true;
+
+            if (help.size() > 0) {
+                sink_.write("# HELP ");
+                sink_.write(name);
+                sink_.write(" ");
+                sink_.write(help);
+                sink_.write("\n");
+            }
+            sink_.write("# TYPE ");
+            sink_.write(name);
+            sink_.write(" ");
+            sink_.write(type);
+            sink_.write("\n");
+        }
+
+        void sample(const SampleRef& sample) override
+        {
+            sink_.write(sample.name);
+            sink_.write(sample.suffix);
+
+            const auto& labelNames = sample.labelNames;
+            const auto& labelValues = sample.labelValues;
+            assert(labelNames.size() == labelValues.size());
+            if (labelValues.size() > 0 || !sample.extraLabelName.empty()) {
+                sink_.write("{");
+                if (!sample.renderedLabels.empty()) {
+                    sink_.write(sample.renderedLabels);
+                } else {
+                    for (size_t i = 0; i < labelValues.size(); ++i) {
+                        if (i > 0) {
+                            sink_.write(",");
+                        }
+                        writeLabel(labelNames[i], labelValues[i]);
+                    }
+                }
+                if (!sample.extraLabelName.empty()) {
+                    if (labelValues.size() > 0) {
+                        sink_.write(",");
+                    }
+                    writeLabel(sample.extraLabelName, sample.extraLabelValue);
+                }
+                sink_.write("}");
+            }
+
+            char buf[32];
+            sink_.write(" ");
+            if (sample.integerValue) {
+                const auto res = std::to_chars(buf, buf + sizeof(buf), *sample.integerValue);
+                sink_.write(std::string_view(buf, res.ptr - buf));
+            } else {
+                sink_.write(detail::toString(sample.value, buf));
+            }
+            sink_.write("\n");
+        }
+
+    private:
+        void writeLabel(std::string_view name, std::string_view value)
+        {
+            sink_.write(name);
+            sink_.write("=\"");
+            // TODO: Worry about escaping this string
+            sink_.write(value);
+            sink_.write("\"");
+        }
+
+        Sink& sink_;
+        bool inFamily_ = false;
+    };
+
+    // https://github.com/prometheus/client_model/blob/master/io/prometheus/client/metrics.proto
+    // Writes length-delimited io.prometheus.client.MetricFamily messages. The messages are built in
+    // buffers that are reused for every family and every metric, so that after the first few
+    // samples this does not allocate anymore.
+    class ProtobufSerializer : public SampleVisitor {
+    public:
+        ProtobufSerializer(Sink& sink)
+            : sink_(sink)
+        {
+        }
+
+        ~ProtobufSerializer() { finishFamily(); }
+
+        void family(std::string_view name, std::string_view help, std::string_view type) override
+        {
+            using namespace detail::protobuf;
+            finishFamily();
+            inFamily_ = true;
+            familyName_.assign(name);
+            type_ = getType(type);
+            writeBytes(family_, 1, name); // name
+            if (!help.empty()) {
+                writeBytes(family_, 2, help); // help
+            }
+            writeUint64(family_, 3, static_cast<uint64_t>(type_)); // type
+        }
+
+        void sample(const SampleRef& sample) override
+        {
+            using namespace detail::protobuf;
+            assert(inFamily_);
+            writeLabels(sample.labelNames, sample.labelValues);
+            // The upper bound of histogram buckets and the quantile of summaries are not labels in
+            // this format
+            const auto grouped = type_ == Type::Histogram || type_ == Type::Summary;
+            const auto boundLabel = type_ == Type::Histogram ? "le" : "quantile";
+            std::string_view bound;
+            if (!sample.extraLabelName.empty()) {
+                if (grouped && sample.extraLabelName == boundLabel) {
+                    bound = sample.extraLabelValue;
+                } else {
+                    writeLabel(sample.extraLabelName, sample.extraLabelValue);
+                }
+            }
+
+            if (!grouped) {
+                finishMetric();
+                value_.clear();
+                writeDouble(value_, 1, sample.value); // Counter/Gauge/Untyped.value
+                metric_ = labels_;
+                writeBytes(metric_, valueField(), value_);
+                writeBytes(family_, 4, metric_); // MetricFamily.metric
+                return;
+            }
+
+            // Histograms and summaries are made up of multiple samples (_bucket/quantiles, _sum,
+            // _count), which we collect into a single metric. They are distinguished by their
+            // labels without "le"/"quantile".
+            if (!inHistogram_ || labels_ != histogramLabels_) {
+                finishMetric();
+                inHistogram_ = true;
+                histogramLabels_ = labels_;
+            }
+            const auto suffix = getSuffix(sample);
+            if (type_ == Type::Summary && suffix.empty() && !bound.empty()) {
+                double quantile = 0.0;
+                std::from_chars(bound.data(), bound.data() + bound.size(), quantile);
+                value_.clear();
+                writeDouble(value_, 1, quantile); // quantile
+                writeDouble(value_, 2, sample.value); // value
+                writeBytes(buckets_, 3, value_); // Summary.quantile
+            } else if (suffix == "_bucket") {
+                // The +Inf bucket is implied by sample_count
+                if (bound != "+Inf") {
+                    double upperBound = 0.0;
+                    std::from_chars(bound.data(), bound.data() + bound.size(), upperBound);
+                    value_.clear();
+                    writeUint64(value_, 1, integer(sample)); // cumulative_count
+                    writeDouble(value_, 2, upperBound); // upper_bound
+                    writeBytes(buckets_, 3, value_); // Histogram.bucket
+                }
+            } else if (suffix == "_sum") {
+                histogramSum_ = sample.value;
+            } else if (suffix == "_count") {
+                histogramCount_ = integer(sample);
+            }
+        }
+
+        void nativeHistogram(const NativeHistogramRef& histogram) override
+        {
+            using namespace detail::protobuf;
+            assert(inFamily_);
+            finishMetric();
+            writeLabels(histogram.labelNames, histogram.labelValues);
+            const auto& snapshot = histogram.snapshot;
+            value_.clear();
+            writeUint64(value_, 1, snapshot.count); // sample_count
+            writeDouble(value_, 2, snapshot.sum); // sample_sum
+            writeSint64(value_, 5, snapshot.schema); // schema
+            writeDouble(value_, 6, snapshot.zeroThreshold); // zero_threshold
+            writeUint64(value_, 7, snapshot.zeroCount); // zero_count
+            writeBuckets(snapshot.negativeBuckets, 9, 10); // negative_span, negative_delta
+            writeBuckets(snapshot.positiveBuckets, 12, 13); // positive_span, positive_delta
+            if (snapshot.positiveBuckets.empty() && snapshot.negativeBuckets.empty()) {
+                // Without any spans Prometheus would not recognize this as a native histogram
+                writeBytes(value_, 12, {}); // positive_span with offset 0 and length 0
+            }
+            metric_ = labels_;
+            writeBytes(metric_, 7, value_); // Metric.histogram
+            writeBytes(family_, 4, metric_); // MetricFamily.metric
+        }
+
+    private:
+        enum class Type : uint8_t {
+            Counter = 0,
+            Gauge = 1,
+            Summary = 2,
+            Untyped = 3,
+            Histogram = 4,
+        };
+
+        static Type getType(std::string_view type)
+        {
+            if (type == "counter") {
+                return Type::Counter;
+            } else if (type == "gauge") {
+                return Type::Gauge;
+            } else if (type == "histogram") {
+                return Type::Histogram;
+            } else if (type == "summary") {
+                return Type::Summary;
+            }
+            return Type::Untyped;
+        }
+
+        uint32_t valueField() const
+        {
+            switch (type_) {
+            case Type::Counter:
+                return 3;
+            case Type::Gauge:
+                return 2;
+            default:
+                return 5; // untyped
+            }
+        }
+
+        void writeLabel(std::string_view name, std::string_view value)
+        {
+            using namespace detail::protobuf;
+            labelPair_.clear();
+            writeBytes(labelPair_, 1, name); // name
+            writeBytes(labelPair_, 2, value); // value
+            writeBytes(labels_, 1, labelPair_); // Metric.label
+        }
+
+        void writeLabels(const std::vector<std::string>& names, const LabelValues& values)
+        {
+            labels_.clear();
+            assert(names.size() == values.size());
+            for (size_t i = 0; i < names.size(); ++i) {
+                writeLabel(names[i], values[i]);
+            }
+        }
+
+        // Writes the buckets as spans of consecutive buckets and the differences between the
+        // counts of neighbouring buckets (the first one is relative to 0).
+        void writeBuckets(const std::vector<std::pair<int32_t, uint64_t>>& buckets,
+            uint32_t spanField, uint32_t deltaField)
+        {
+            using namespace detail::protobuf;
+            if (buckets.empty()) {
+                return;
+            }
+            deltas_.clear();
+            int32_t spanStart = buckets.front().first;
+            int32_t lastIndex = spanStart;
+            uint32_t spanLength = 0;
+            int64_t lastCount = 0;
+            const auto writeSpan = [&](int32_t offset) {
+                spanBuf_.clear();
+                writeSint64(spanBuf_, 1, offset); // offset
+                writeUint64(spanBuf_, 2, spanLength); // length
+                writeBytes(value_, spanField, spanBuf_);
+            };
+            int32_t offset = spanStart; // The offset of the first span is the absolute index
+            for (const auto& [index, count] : buckets) {
+                // Small gaps are cheaper to encode as empty buckets than as a new span
+                if (index - lastIndex > 3) {
+                    writeSpan(offset);
+                    offset = index - lastIndex - 1;
+                    spanLength = 0;
+                } else {
+                    for (auto i = lastIndex + 1; i < index; ++i) {
+                        writeVarint(deltas_, zigZag(-lastCount));
+                        lastCount = 0;
+                        spanLength++;
+                    }
+                }
+                const auto value = static_cast<int64_t>(count);
+                writeVarint(deltas_, zigZag(value - lastCount));
+                lastCount = value;
+                lastIndex = index;
+                spanLength++;
+            }
+            writeSpan(offset);
+            writeBytes(value_, deltaField, deltas_); // packed
+        }
+
+        // Counts are exact, if the collector passes them as integers
+        static uint64_t integer(const SampleRef& sample)
+        {
+            if (sample.integerValue) {
+                return static_cast<uint64_t>(*sample.integerValue);
+            }
+            return static_cast<uint64_t>(sample.value);
+        }
+
+        // Samples from Collector::Sample have the full name and no suffix
+        std::string_view getSuffix(const SampleRef& sample) const
+        {
+            if (sample.name.size() > familyName_.size()) {
+                return sample.name.substr(familyName_.size());
+            }
+            return sample.suffix;
+        }
+
+        void finishMetric()
+        {
+            using namespace detail::protobuf;
+            if (!inHistogram_) {
+                return;
+            }
+            value_.clear();
+            writeUint64(value_, 1, histogramCount_); // sample_count
+            writeDouble(value_, 2, histogramSum_); // sample_sum
+            value_.append(buckets_);
+            metric_ = histogramLabels_;
+            // Summary and Histogram have the same field numbers for the count and sum
+            writeBytes(metric_, type_ == Type::Summary ? 4 : 7, value_); // Metric.summary/histogram
+            writeBytes(family_, 4, metric_); // MetricFamily.metric
+
+            inHistogram_ = false;
+            buckets_.clear();
+            histogramSum_ = 0.0;
+            histogramCount_ = 0;
+        }
+
+        void finishFamily()
+        {
+            if (!inFamily_) {
+                return;
+            }
+            finishMetric();
+            std::string length;
+            detail::protobuf::writeVarint(length, family_.size());
+            sink_.write(length);
+            sink_.write(family_);
+            family_.clear();
+            inFamily_ = false;
+        }
+
+        Sink& sink_;
+        bool inFamily_ = false;
+        std::string familyName_;
+        Type type_ = Type::Untyped;
+        std::string family_;
+        std::string metric_;
+        std::string labels_;
+        std::string labelPair_;
+        std::string value_;
+
+        std::string spanBuf_;
+        std::string deltas_;
+
+        bool inHistogram_ = false;
+        std::string histogramLabels_;
+        std::string buckets_;
+        double histogramSum_ = 0.0;
+        uint64_t histogramCount_ = 0;
+    };
+
+    template <typename Func>
+    void withSerializer(Sink& sink, Format format, Func&& func)
+    {
+        if (format == Format::Protobuf) {
+            ProtobufSerializer serializer(sink);
+            func(serializer);
+        } else {
+            TextSerializer serializer(sink);
+            func(serializer);
+        }
+    }
+
+    // Builds the return value of Collector::collect() from collect(SampleVisitor&)
+    class FamilyBuilder : public SampleVisitor {
+    public:
+        std::vector<Collector::Family> families;
+
+        void family(std::string_view name, std::string_view help, std::string_view type) override
+        {
+            families.push_back(Collector::Family {
+                std::string(name), std::string(help), std::string(type), {} });
+        }
+
+        void sample(const SampleRef& sample) override
+        {
+            assert(!families.empty());
+            Collector::Sample s { std::string(sample.name).append(sample.suffix), sample.value,
+                sample.labelNames, sample.labelValues, sample.integerValue };
+            if (!sample.extraLabelName.empty()) {
+                s.labelNames.emplace_back(sample.extraLabelName);
+                s.labelValues.emplace_back(sample.extraLabelValue);
+            }
+            families.back().samples.push_back(std::move(s));
+        }
+    };
+
+    void visit(SampleVisitor& visitor, const std::vector<Collector::Family>& families)
+    {
+        // Collector::Sample has "le" of histogram buckets and "quantile" of summaries as a regular
+        // label, but the serializers expect it as the extra label (in the protobuf format it is
+        // not a label at all), like MetricFamily passes it.
+        std::vector<std::string> labelNames;
+        std::vector<std::string_view> labelValues;
+        for (const auto& family : families) {
+            visitor.family(family.name, family.help, family.type);
+            const std::string_view boundLabel = family.type == "histogram" ? "le"
+                : family.type == "summary"                                 ? "quantile"
+                                                                           : "";
+            for (const auto& sample : family.samples) {
+                const auto bound = boundLabel.empty()
+                    ? sample.labelNames.end()
+                    : std::find(sample.labelNames.begin(), sample.labelNames.end(), boundLabel);
+                if (bound == sample.labelNames.end()) {
+                    visitor.sample(SampleVisitor::SampleRef { sample.name, {}, sample.labelNames,
+                        sample.labelValues, sample.value, {}, {}, {}, sample.integerValue });
+                    continue;
+                }
+
+                const auto boundIndex = static_cast<size_t>(bound - sample.labelNames.begin());
+                labelNames.clear();
+                labelValues.clear();
+                std::string_view boundValue;
+                size_t i = 0;
+                for (const auto& value : sample.labelValues) {
+                    if (i == boundIndex) {
+                        boundValue = value;
+                    } else {
+                        labelNames.push_back(sample.labelNames[i]);
+                        labelValues.push_back(value);
+                    }
+                    ++i;
+                }
+                const LabelValues otherValues(labelValues.begin(), labelValues.end());
+                visitor.sample(SampleVisitor::SampleRef { sample.name, {}, labelNames, otherValues,
+                    sample.value, boundLabel, boundValue, {}, sample.integerValue });
+            }
+        }
+    }
+
+    // Collects small writes and passes them on to another sink in bigger chunks
+    class BufferedSink : public Sink {
+    public:
+        BufferedSink(Sink& sink, size_t chunkSize)
+            : sink_(sink)
+            , chunkSize_(chunkSize)
+        {
+            buffer_.reserve(chunkSize_);
+        }
+
+        void write(std::string_view data) override
+        {
+            if (buffer_.size() + data.size() > chunkSize_) {
+                flush();
+            }
+            if (data.size() >= chunkSize_) {
+                sink_.write(data);
+            } else {
+                buffer_.append(data);
+            }
+        }
+
+        void flush()
+        {
+            if (!buffer_.empty()) {
+                sink_.write(buffer_);
+                buffer_.clear();
+            }
+        }
+
+    private:
+        Sink& sink_;
+        size_t chunkSize_;
+        std::string buffer_;
+    };
+
+    // Passes everything on to another sink and counts the bytes
+    class CountingSink : public Sink {
+    public:
+        CountingSink(Sink& sink)
+            : sink_(sink)
+        {
+        }
+
+        void write(std::string_view data) override
+        {
+            bytes_ += data.size();
+            sink_.write(data);
+        }
+
+        uint64_t bytes() const { return bytes_; }
+
+    private:
+        Sink& sink_;
+        uint64_t bytes_ = 0;
+    };
+
+    double secondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+std::string_view contentType(Format format)
+{
+    if (format == Format::Protobuf) {
+        return "application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; "
+               "encoding=delimited";
+    }
+    return "text/plain; version=0.0.4";
+}
+
+void SampleVisitor::nativeHistogram(const NativeHistogramRef& histogram)
+{
+    const auto& [name, labelNames, labelValues, snapshot, rendered] = histogram;
+    const auto count = static_cast<double>(snapshot.count);
+    const auto integerCount = static_cast<int64_t>(snapshot.count);
+    sample(SampleRef {
+        name, "_bucket", labelNames, labelValues, count, "le", "+Inf", rendered, integerCount });
+    sample(SampleRef { name, "_sum", labelNames, labelValues, snapshot.sum, {}, {}, rendered });
+    sample(SampleRef {
+        name, "_count", labelNames, labelValues, count, {}, {}, rendered, integerCount });
+}
+
+void serialize(Sink& sink, const std::vector<Collector::Family>& families, Format format)
+{
+    withSerializer(
+        sink, format, [&families](SampleVisitor& serializer) { visit(serializer, families); });
+}
+
+std::string serialize(const std::vector<Collector::Family>& families, Format format)
+{
+    std::string str;
+    str.reserve(4096);
+    StringSink sink(str);
+    serialize(sink, families, format);
+    return str;
+}
+
+std::vector<Collector::Family> Collector::collect() const
+{
+    FamilyBuilder builder;
+    collect(builder);
+    return std::move(builder.families);
+}
+
+void Collector::collect(SampleVisitor& visitor) const
+{
+    visit(visitor, collect());
+}
+
+void Collector::serialize(Sink& sink, Format format) const
+{
+    withSerializer(sink, format, [this](SampleVisitor& serializer) { collect(serializer); });
+}
+
+Collector::Info Collector::info() const
+{
+    return {};
+}
+
+template <>
+void MetricFamily<Counter>::collectSamples(SampleVisitor& visitor) const
+{
+    visitor.family(name_, help_, "counter");
+    for (const auto& child : snapshotChildren()) {
+        const auto& metric = child->metric;
+        visitor.sample(SampleVisitor::SampleRef { name_, {}, labelNames_, metric.labelValues(),
+            metric.value(), {}, {}, child->renderedLabels });
+    }
+    collectOverflows(visitor);
+}
+
+template <>
+void MetricFamily<Gauge>::collectSamples(SampleVisitor& visitor) const
+{
+    visitor.family(name_, help_, "gauge");
+    for (const auto& child : snapshotChildren()) {
+        const auto& metric = child->metric;
+        visitor.sample(SampleVisitor::SampleRef { name_, {}, labelNames_, metric.labelValues(),
+            metric.value(), {}, {}, child->renderedLabels });
+    }
+    collectOverflows(visitor);
+}
+
+template <>
+void MetricFamily<IntCounter>::collectSamples(SampleVisitor& visitor) const
+{
+    visitor.family(name_, help_, "counter");
+    for (const auto& child : snapshotChildren()) {
+        const auto& metric = child->metric;
+        const auto value = metric.value();
+        visitor.sample(SampleVisitor::SampleRef { name_, {}, labelNames_, metric.labelValues(),
+            static_cast<double>(value), {}, {}, child->renderedLabels,
+            static_cast<int64_t>(value) });
+    }
+    collectOverflows(visitor);
+}
+
+template <>
+void MetricFamily<IntGauge>::collectSamples(SampleVisitor& visitor) const
+{
+    visitor.family(name_, help_, "gauge");
+    for (const auto& child : snapshotChildren()) {
+        const auto& metric = child->metric;
+        const auto value = metric.value();
+        visitor.sample(SampleVisitor::SampleRef { name_, {}, labelNames_, metric.labelValues(),
+            static_cast<double>(value), {}, {}, child->renderedLabels, value });
+    }
+    collectOverflows(visitor);
+}
+
+template <>
+void MetricFamily<Histogram>::collectSamples(SampleVisitor& visitor) const
+{
+    for (const auto& labelName : labelNames_) {
+        assert(labelName != "le");
+    }
+
+    visitor.family(name_, help_, "histogram");
+    for (const auto& child : snapshotChildren()) {
+        const auto& metric = child->metric;
+        const auto& labelValues = metric.labelValues();
+        const auto& rendered = child->renderedLabels;
+        // All samples come from one snapshot, so _count always matches the +Inf bucket and _sum
+        const auto snapshot = metric.snapshot();
+        const auto& upperBounds = metric.upperBounds();
+        // The buckets store non-cumulative counts, but le buckets are cumulative
+        uint64_t cumulativeCount = 0;
+        for (size_t i = 0; i < upperBounds.size(); ++i) {
+            cumulativeCount += snapshot.bucketCounts[i];
+            char buf[32];
+            visitor.sample(SampleVisitor::SampleRef { name_, "_bucket", labelNames_, labelValues,
+                static_cast<double>(cumulativeCount), "le", detail::toString(upperBounds[i], buf),
+                rendered, static_cast<int64_t>(cumulativeCount) });
+        }
+        visitor.sample(SampleVisitor::SampleRef {
+            name_, "_sum", labelNames_, labelValues, snapshot.sum, {}, {}, rendered });
+        visitor.sample(SampleVisitor::SampleRef { name_, "_count", labelNames_, labelValues,
+            static_cast<double>(cumulativeCount), {}, {}, rendered,
+            static_cast<int64_t>(cumulativeCount) });
+    }
+    collectOverflows(visitor);
+}
+
+template <>
+void MetricFamily<NativeHistogram>::collectSamples(SampleVisitor& visitor) const
+{
+    for (const auto& labelName : labelNames_) {
+        assert(labelName != "le");
+    }
+
+    visitor.family(name_, help_, "histogram");
+    for (const auto& child : snapshotChildren()) {
+        const auto& metric = child->metric;
+        const auto snapshot = metric.snapshot();
+        visitor.nativeHistogram(SampleVisitor::NativeHistogramRef {
+            name_, labelNames_, metric.labelValues(), snapshot, child->renderedLabels });
+    }
+    collectOverflows(visitor);
+}
+
+template <>
+void MetricFamily<Summary>::collectSamples(SampleVisitor& visitor) const
+{
+    for (const auto& labelName : labelNames_) {
+        assert(labelName != "quantile");
+    }
+
+    visitor.family(name_, help_, "summary");
+    for (const auto& child : snapshotChildren()) {
+        const auto& metric = child->metric;
+        const auto& labelValues = metric.labelValues();
+        const auto& rendered = child->renderedLabels;
+        for (const auto& quantile : metric.quantiles()) {
+            char buf[32];
+            visitor.sample(SampleVisitor::SampleRef { name_, {}, labelNames_, labelValues,
+                quantile.value, "quantile", detail::toString(quantile.quantile, buf), rendered });
+        }
+        visitor.sample(SampleVisitor::SampleRef {
+            name_, "_sum", labelNames_, labelValues, metric.sum(), {}, {}, rendered });
+        const auto count = metric.count();
+        visitor.sample(SampleVisitor::SampleRef { name_, "_count", labelNames_, labelValues,
+            static_cast<double>(count), {}, {}, rendered, static_cast<int64_t>(count) });
+    }
+    collectOverflows(visitor);
+}
+
+std::shared_ptr<MetricFamily<Counter>> makeCounter(std::string name,
+    std::vector<std::string> labelNames, std::string help, Counter::Descriptor descriptor)
+{
+    return std::make_shared<MetricFamily<Counter>>(
+        std::move(name), std::move(labelNames), std::move(help), std::move(descriptor));
+}
+
+std::shared_ptr<MetricFamily<Gauge>> makeGauge(
+    std::string name, std::vector<std::string> labelNames, std::string help)
+{
+    return std::make_shared<MetricFamily<Gauge>>(
+        std::move(name), std::move(labelNames), std::move(help));
+}
+
+std::shared_ptr<MetricFamily<IntCounter>> makeIntCounter(
+    std::string name, std::vector<std::string> labelNames, std::string help)
+{
+    return std::make_shared<MetricFamily<IntCounter>>(
+        std::move(name), std::move(labelNames), std::move(help));
+}
+
+std::shared_ptr<MetricFamily<IntGauge>> makeIntGauge(
+    std::string name, std::vector<std::string> labelNames, std::string help)
+{
+    return std::make_shared<MetricFamily<IntGauge>>(
+        std::move(name), std::move(labelNames), std::move(help));
+}
+
+std::shared_ptr<MetricFamily<Histogram>> makeHistogram(std::string name,
+    std::vector<std::string> labelNames, std::vector<double> bucketBounds, std::string help)
+{
+    return std::make_shared<MetricFamily<Histogram>>(std::move(name), std::move(labelNames),
+        std::move(help), Histogram::Descriptor { std::move(bucketBounds) });
+}
+
+std::shared_ptr<MetricFamily<NativeHistogram>> makeNativeHistogram(std::string name,
+    std::vector<std::string> labelNames, std::string help, NativeHistogram::Descriptor descriptor)
+{
+    return std::make_shared<MetricFamily<NativeHistogram>>(
+        std::move(name), std::move(labelNames), std::move(help), std::move(descriptor));
+}
+
+std::shared_ptr<MetricFamily<Summary>> makeSummary(std::string name,
+    std::vector<std::string> labelNames, std::string help, Summary::Descriptor descriptor)
+{
+    return std::make_shared<MetricFamily<Summary>>(
+        std::move(name), std::move(labelNames), std::move(help), std::move(descriptor));
+}
+
+Registry& Registry::getDefault()
+{
+    static Registry reg;
+    return reg;
+}
+
+MetricFamily<Counter>& Registry::counter(std::string name, std::vector<std::string> labelNames,
+    std::string help, Counter::Descriptor descriptor)
+{
+    auto f = makeCounter(
+        std::move(name), std::move(labelNames), std::move(help), std::move(descriptor));
+    registerCollector(f);
+    return *f;
+}
+
+Counter& Registry::counter(std::string name, std::string help, Counter::Descriptor descriptor)
+{
+    return counter(std::move(name), {}, std::move(help), std::move(descriptor)).labels();
+}
+
+MetricFamily<Gauge>& Registry::gauge(
+    std::string name, std::vector<std::string> labelNames, std::string help)
+{
+    auto f = makeGauge(std::move(name), std::move(labelNames), std::move(help));
+    registerCollector(f);
+    return *f;
+}
+
+Gauge& Registry::gauge(std::string name, std::string help)
+{
+    return gauge(std::move(name), {}, std::move(help)).labels();
+}
+
+MetricFamily<IntCounter>& Registry::intCounter(
+    std::string name, std::vector<std::string> labelNames, std::string help)
+{
+    auto f = makeIntCounter(std::move(name), std::move(labelNames), std::move(help));
+    registerCollector(f);
+    return *f;
+}
+
+IntCounter& Registry::intCounter(std::string name, std::string help)
+{
+    return intCounter(std::move(name), {}, std::move(help)).labels();
+}
+
+MetricFamily<IntGauge>& Registry::intGauge(
+    std::string name, std::vector<std::string> labelNames, std::string help)
+{
+    auto f = makeIntGauge(std::move(name), std::move(labelNames), std::move(help));
+    registerCollector(f);
+    return *f;
+}
+
+IntGauge& Registry::intGauge(std::string name, std::string help)
+{
+    return intGauge(std::move(name), {}, std::move(help)).labels();
+}
+
+MetricFamily<Histogram>& Registry::histogram(std::string name, std::vector<std::string> labelNames,
+    std::vector<double> bucketBounds, std::string help)
+{
+    auto f = makeHistogram(
+        std::move(name), std::move(labelNames), std::move(bucketBounds), std::move(help));
+    registerCollector(f);
+    return *f;
+}
+
+Histogram& Registry::histogram(std::string name, std::vector<double> bucketBounds, std::string help)
+{
+    return histogram(std::move(name), {}, std::move(bucketBounds), std::move(help)).labels();
+}
+
+MetricFamily<NativeHistogram>& Registry::nativeHistogram(std::string name,
+    std::vector<std::string> labelNames, std::string help, NativeHistogram::Descriptor descriptor)
+{
+    auto f = makeNativeHistogram(
+        std::move(name), std::move(labelNames), std::move(help), std::move(descriptor));
+    registerCollector(f);
+    return *f;
+}
+
+NativeHistogram& Registry::nativeHistogram(
+    std::string name, std::string help, NativeHistogram::Descriptor descriptor)
+{
+    return nativeHistogram(std::move(name), {}, std::move(help), std::move(descriptor)).labels();
+}
+
+MetricFamily<Summary>& Registry::summary(std::string name, std::vector<std::string> labelNames,
+    std::string help, Summary::Descriptor descriptor)
+{
+    auto f = makeSummary(
+        std::move(name), std::move(labelNames), std::move(help), std::move(descriptor));
+    registerCollector(f);
+    return *f;
+}
+
+Summary& Registry::summary(std::string name, std::string help, Summary::Descriptor descriptor)
+{
+    return summary(std::move(name), {}, std::move(help), std::move(descriptor)).labels();
+}
+
+Registry& Registry::registerCollector(std::shared_ptr<Collector> collector)
+{
+    std::lock_guard g(mutex_);
+    assert(std::find(collectors_.begin(), collectors_.end(), collector) == collectors_.end());
+    collectors_.push_back(collector);
+    std::lock_guard sg(statsMutex_);
+    stats_.push_back(CollectorStats { std::move(collector) });
+    return *this;
+}
+
+void Registry::collect(SampleVisitor& visitor) const
+{
+    std::lock_guard g(mutex_);
+    for (size_t i = 0; i < collectors_.size(); ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        collectors_[i]->collect(visitor);
+        const auto duration = secondsSince(start);
+        std::lock_guard sg(statsMutex_);
+        stats_[i].collectSeconds = duration;
+    }
+}
+
+std::vector<Registry::CollectorStats> Registry::collectorStats() const
+{
+    std::lock_guard g(statsMutex_);
+    return stats_;
+}
+
+std::string Registry::serialize(Format format) const
+{
+    if (cacheEnabled()) {
+        return *serializeCached(format);
+    }
+    std::string str;
+    str.reserve(4096);
+    StringSink sink(str);
+    serializeUncached(sink, format);
+    return str;
+}
+
+void Registry::serialize(Sink& sink, Format format, size_t chunkSize) const
+{
+    if (cacheEnabled()) {
+        const auto output = serializeCached(format);
+        for (size_t offset = 0; offset < output->size(); offset += chunkSize) {
+            sink.write(std::string_view(*output).substr(offset, chunkSize));
+        }
+        return;
+    }
+    BufferedSink buffered(sink, chunkSize);
+    serializeUncached(buffered, format);
+    buffered.flush();
+}
+
+void Registry::setCacheMaxAge(double maxAge)
+{
+    std::lock_guard g(cacheMutex_);
+    cacheMaxAge_ = maxAge;
+}
+
+std::shared_ptr<const std::string> Registry::serializeCached(Format format) const
+{
+    using Clock = std::chrono::steady_clock;
+    auto& entry = cache_[static_cast<size_t>(format)];
+    std::unique_lock lock(cacheMutex_);
+    const auto maxAge = std::chrono::duration<double>(cacheMaxAge_);
+    while (true) {
+        if (entry.output && Clock::now() - entry.time <= maxAge) {
+            return entry.output;
+        }
+        if (!entry.inProgress) {
+            break;
+        }
+        // Someone else is serializing right now, so we just use their output
+        const auto previous = entry.output;
+        cacheDone_.wait(lock);
+        if (entry.output != previous) {
+            return entry.output;
+        }
+    }
+
+    entry.inProgress = true;
+    // Resets inProgress even if a collector or the sink throws. The waiting threads then find
+    // the output unchanged and no serialization in progress, so one of them retries.
+    struct InProgressReset {
+        std::unique_lock<CPPROM_MUTEX>& lock;
+        CacheEntry& entry;
+        std::condition_variable_any& done;
+
+        ~InProgressReset()
+        {
+            if (!lock.owns_lock()) {
+                lock.lock();
+            }
+            entry.inProgress = false;
+            done.notify_all();
+        }
+    } reset { lock, entry, cacheDone_ };
+
+    lock.unlock();
+    const auto start = Clock::now();
+    auto output = std::make_shared<std::string>();
+    output->reserve(4096);
+    StringSink sink(*output);
+    serializeUncached(sink, format);
+
+    lock.lock();
+    entry.output = std::move(output);
+    entry.time = start;
+    return entry.output;
+}
+
+bool Registry::cacheEnabled() const
+{
+    std::lock_guard g(cacheMutex_);
+    return cacheMaxAge_ > 0.0;
+}
+
+void Registry::setCollectionThreads(size_t threads)
+{
+#ifdef CPPROM_SINGLE_THREADED
+    // The collectors are not thread-safe in this configuration
+    assert(threads <= 1);
+    threads = 1;
+#endif
+    std::lock_guard g(mutex_);
+    collectionThreads_ = threads;
+}
+
+void Registry::serializeUncached(Sink& sink, Format format) const
+{
+    std::lock_guard g(mutex_);
+    const auto threads = std::min(collectionThreads_, collectors_.size());
+    if (threads <= 1) {
+        for (size_t i = 0; i < collectors_.size(); ++i) {
+            const auto start = std::chrono::steady_clock::now();
+            CountingSink counting(sink);
+            collectors_[i]->serialize(counting, format);
+            const auto duration = secondsSince(start);
+            std::lock_guard sg(statsMutex_);
+            stats_[i].serializeSeconds = duration;
+            stats_[i].serializeBytes = counting.bytes();
+        }
+        return;
+    }
+
+    std::vector<std::string> outputs(collectors_.size());
+    std::vector<std::exception_ptr> errors(threads);
+    std::atomic<size_t> next { 0 };
+    // Every thread takes the next collector, until there are none left. An exception stops all
+    // threads and is rethrown once they are joined, because a std::thread that is not joined
+    // terminates the program and an exception that leaves a thread does the same.
+    const auto work = [this, format, &outputs, &errors, &next](size_t thread) {
+        try {
+            for (auto i = next++; i < collectors_.size(); i = next++) {
+                const auto start = std::chrono::steady_clock::now();
+                StringSink collectorSink(outputs[i]);
+                collectors_[i]->serialize(collectorSink, format);
+                const auto duration = secondsSince(start);
+                std::lock_guard sg(statsMutex_);
+                stats_[i].serializeSeconds = duration;
+                stats_[i].serializeBytes = outputs[i].size();
+            }
+        } catch (...) {
+            errors[thread] = std::current_exception();
+            next = collectors_.size();
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t i = 1; i < threads; ++i) {
+        try {
+            workers.emplace_back(work, i);
+        } catch (const std::system_error&) {
+            // The threads that did start (and this one) still do all the work
+            break;
+        }
+    }
+    work(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    for (const auto& output : outputs) {
+        sink.write(output);
+    }
+}
+
+namespace {
+    class SelfMetricsCollector : public Collector {
+    public:
+        SelfMetricsCollector(const Registry& registry)
+            : registry_(registry)
+        {
+        }
+
+        using Collector::collect;
+
+        std::vector<Family> collect() const override
+        {
+            std::vector<Family> families {
+                { "cpprom_collector_serialize_duration_seconds",
+                    "How long the collector took to serialize the last time", "gauge", {} },
+                { "cpprom_collector_serialize_bytes",
+                    "The size of the output of the collector the last time it was serialized",
+                    "gauge", {} },
+                { "cpprom_collector_collect_duration_seconds",
+                    "How long the collector took the last time it was collected by "
+                    "Registry::collect",
+                    "gauge", {} },
+                { "cpprom_family_children", "The number of children of the family", "gauge", {} },
+                { "cpprom_family_label_bytes",
+                    "Roughly how much memory the labels of the children of the family take up",
+                    "gauge", {} },
+            };
+            const std::vector<std::string> collectorLabel { "collector" };
+            const std::vector<std::string> familyLabel { "family" };
+            const auto stats = registry_.collectorStats();
+            for (size_t i = 0; i < stats.size(); ++i) {
+                auto info = stats[i].collector->info();
+                if (info.name.empty()) {
+                    info.name = "collector_" + std::to_string(i);
+                }
+                const LabelValues labelValues { info.name };
+                families[0].samples.push_back(
+                    { families[0].name, stats[i].serializeSeconds, collectorLabel, labelValues });
+                families[1].samples.push_back({ families[1].name,
+                    static_cast<double>(stats[i].serializeBytes), collectorLabel, labelValues });
+                families[2].samples.push_back(
+                    { families[2].name, stats[i].collectSeconds, collectorLabel, labelValues });
+                if (info.children) {
+                    families[3].samples.push_back({ families[3].name,
+                        static_cast<double>(*info.children), familyLabel, labelValues });
+                    families[4].samples.push_back({ families[4].name,
+                        static_cast<double>(info.labelBytes), familyLabel, labelValues });
+                }
+            }
+            return families;
+        }
+
+        Info info() const override { return { "cpprom_self_metrics" }; }
+
+    private:
+        const Registry& registry_;
+    };
+}
+
+std::shared_ptr<Collector> makeSelfMetricsCollector(const Registry& registry)
+{
+    return std::make_shared<SelfMetricsCollector>(registry);
 }
 }
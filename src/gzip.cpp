@@ -0,0 +1,101 @@
+#include "cpprom/gzip.hpp"
+
+#include <optional>
+
+#include <zlib.h>
+
+#include "util.hpp"
+
+namespace cpprom {
+struct GzipSink::Stream {
+    z_stream stream {};
+};
+
+GzipSink::GzipSink(Sink& sink, int level, size_t bufferSize)
+    : sink_(sink)
+    , stream_(std::make_unique<Stream>())
+    , buffer_(bufferSize, '\0')
+{
+    assert(bufferSize > 0);
+    // 15 is the default window size and +16 makes zlib write a gzip header and trailer
+    const auto res
+        = ::deflateInit2(&stream_->stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    assert(res == Z_OK);
+    (void)res;
+}
+
+GzipSink::~GzipSink()
+{
+    finish();
+    ::deflateEnd(&stream_->stream);
+}
+
+void GzipSink::write(std::string_view data)
+{
+    assert(!finished_);
+    // zlib does not modify the input, but this old interface is not const-correct
+    stream_->stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream_->stream.avail_in = static_cast<uInt>(data.size());
+    deflate(Z_NO_FLUSH);
+}
+
+void GzipSink::finish()
+{
+    if (finished_) {
+        return;
+    }
+    stream_->stream.next_in = nullptr;
+    stream_->stream.avail_in = 0;
+    deflate(Z_FINISH);
+    finished_ = true;
+}
+
+void GzipSink::deflate(int flush)
+{
+    // https://zlib.net/zlib_how.html
+    // If deflate fills the whole output buffer, there might be more output pending.
+    do {
+        stream_->stream.next_out = reinterpret_cast<Bytef*>(buffer_.data());
+        stream_->stream.avail_out = static_cast<uInt>(buffer_.size());
+        const auto res = ::deflate(&stream_->stream, flush);
+        assert(res != Z_STREAM_ERROR);
+        (void)res;
+        const auto size = buffer_.size() - stream_->stream.avail_out;
+        if (size > 0) {
+            sink_.write(std::string_view(buffer_.data(), size));
+        }
+    } while (stream_->stream.avail_out == 0);
+}
+
+bool acceptsGzip(std::string_view acceptEncoding)
+{
+    // https://www.rfc-editor.org/rfc/rfc9110#field.accept-encoding
+    // e.g. "gzip", "deflate, gzip;q=1.0, *;q=0.5" or "gzip;q=0" (which forbids it)
+    // An explicit gzip entry takes precedence over *.
+    std::optional<bool> gzip, wildcard;
+    while (!acceptEncoding.empty()) {
+        const auto comma = acceptEncoding.find(',');
+        const auto entry = acceptEncoding.substr(0, comma);
+        acceptEncoding = comma == std::string_view::npos ? std::string_view()
+                                                         : acceptEncoding.substr(comma + 1);
+
+        const auto semicolon = entry.find(';');
+        const auto coding = detail::trim(entry.substr(0, semicolon));
+        auto& accepted = detail::equalsIgnoreCase(coding, "gzip") ? gzip : wildcard;
+        if (!detail::equalsIgnoreCase(coding, "gzip") && coding != "*") {
+            continue;
+        }
+
+        accepted = true;
+        if (semicolon != std::string_view::npos) {
+            const auto param = detail::trim(entry.substr(semicolon + 1));
+            if (param.size() >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                // q=0, q=0.0, q=0.00 etc. mean "not acceptable"
+                accepted = detail::trim(param.substr(2)).find_first_not_of("0.")
+                    != std::string_view::npos;
+            }
+        }
+    }
+    return gzip.value_or(wildcard.value_or(false));
+}
+}
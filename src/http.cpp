@@ -0,0 +1,409 @@
+#include "cpprom/http.hpp"
+
+#include <iostream>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "util.hpp"
+
+#ifdef CPPROM_ZLIB
+#include "cpprom/gzip.hpp"
+#endif
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Requests without a body are tiny, so anything larger is not a request we want to answer
+constexpr size_t maxRequestSize = 16 * 1024;
+
+// Returns the value of the header or an empty string. Does not care about folding.
+std::string_view getHeader(std::string_view headers, std::string_view name)
+{
+    while (!headers.empty()) {
+        const auto lineEnd = std::min(headers.find("\r\n"), headers.size());
+        const auto line = headers.substr(0, lineEnd);
+        headers.remove_prefix(std::min(lineEnd + 2, headers.size()));
+        const auto colon = line.find(':');
+        if (colon != std::string_view::npos
+            && cpprom::detail::equalsIgnoreCase(line.substr(0, colon), name)) {
+            const auto value = line.substr(colon + 1);
+            return value.substr(std::min(value.find_first_not_of(" \t"), value.size()));
+        }
+    }
+    return {};
+}
+
+}
+
+namespace cpprom {
+struct HttpServer::Connection {
+    int fd;
+    Clock::time_point lastActivity;
+    std::string input;
+    // The response currently being sent is header followed by body.
+    // body references either cached or compressed.
+    std::string header;
+    std::shared_ptr<const std::string> cached;
+    std::string compressed;
+    std::string_view body;
+    size_t sent = 0;
+    bool writing = false;
+    bool closeAfterResponse = false;
+};
+
+HttpServer::HttpServer(const Registry& registry, Options options)
+    : registry_(registry)
+    , options_(std::move(options))
+{
+    const auto fail = [this](std::string_view what) {
+        std::cerr << "Error in " << what << ": " << errno << std::endl;
+        for (auto fd : { &listenSocket_, &epollFd_, &stopEvent_ }) {
+            if (*fd != -1) {
+                ::close(*fd);
+                *fd = -1;
+            }
+        }
+    };
+
+    listenSocket_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenSocket_ == -1) {
+        fail("socket");
+        return;
+    }
+
+    const int reuseAddr = 1;
+    if (::setsockopt(listenSocket_, SOL_SOCKET, SO_REUSEADDR, &reuseAddr, sizeof(reuseAddr))
+        == -1) {
+        std::cerr << "Error in setsockopt(SO_REUSEADDR): " << errno << std::endl;
+    }
+
+    ::sockaddr_in sa {};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(options_.port);
+    if (::inet_pton(AF_INET, options_.address.c_str(), &sa.sin_addr) != 1) {
+        fail("inet_pton (invalid address)");
+        return;
+    }
+    if (::bind(listenSocket_, reinterpret_cast<const ::sockaddr*>(&sa), sizeof(sa)) == -1) {
+        fail("bind");
+        return;
+    }
+    if (::listen(listenSocket_, SOMAXCONN) == -1) {
+        fail("listen");
+        return;
+    }
+    ::socklen_t len = sizeof(sa);
+    ::getsockname(listenSocket_, reinterpret_cast<::sockaddr*>(&sa), &len);
+    port_ = ntohs(sa.sin_port);
+
+    epollFd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    stopEvent_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd_ == -1 || stopEvent_ == -1) {
+        fail("epoll_create1/eventfd");
+        return;
+    }
+    for (const auto fd : { listenSocket_, stopEvent_ }) {
+        ::epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        ::epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    thread_ = std::thread(&HttpServer::run, this);
+}
+
+HttpServer::~HttpServer()
+{
+    if (thread_.joinable()) {
+        const uint64_t one = 1;
+        [[maybe_unused]] const auto res = ::write(stopEvent_, &one, sizeof(one));
+        thread_.join();
+    }
+    while (!connections_.empty()) {
+        close(connections_.begin()->first);
+    }
+    for (const auto fd : { listenSocket_, epollFd_, stopEvent_ }) {
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+}
+
+bool HttpServer::listening() const
+{
+    return listenSocket_ != -1;
+}
+
+uint16_t HttpServer::port() const
+{
+    return port_;
+}
+
+void HttpServer::run()
+{
+    const auto idleTimeout = std::chrono::duration<double>(options_.idleTimeout);
+    std::array<::epoll_event, 64> events;
+    std::vector<int> idle;
+    while (true) {
+        const auto num = ::epoll_wait(epollFd_, events.data(), events.size(), 1000);
+        if (num == -1 && errno != EINTR) {
+            std::cerr << "Error in epoll_wait: " << errno << std::endl;
+            return;
+        }
+        for (int i = 0; i < num; ++i) {
+            const auto fd = events[i].data.fd;
+            if (fd == stopEvent_) {
+                return;
+            } else if (fd == listenSocket_) {
+                accept();
+                continue;
+            }
+            const auto it = connections_.find(fd);
+            if (it == connections_.end()) {
+                continue;
+            }
+            auto& connection = *it->second;
+            connection.lastActivity = Clock::now();
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close(fd);
+            } else if (events[i].events & EPOLLOUT) {
+                // Requests that were pipelined behind the response are answered afterwards
+                if (flush(connection)) {
+                    respond(connection);
+                }
+            } else if (events[i].events & EPOLLIN) {
+                receive(connection);
+            }
+        }
+
+        const auto now = Clock::now();
+        idle.clear();
+        for (const auto& [fd, connection] : connections_) {
+            if (now - connection->lastActivity > idleTimeout) {
+                idle.push_back(fd);
+            }
+        }
+        for (const auto fd : idle) {
+            close(fd);
+        }
+    }
+}
+
+void HttpServer::accept()
+{
+    while (true) {
+        const auto fd = ::accept4(listenSocket_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                std::cerr << "Error in accept: " << errno << std::endl;
+            }
+            return;
+        }
+        if (connections_.size() >= options_.maxConnections) {
+            ::close(fd);
+            continue;
+        }
+        const int noDelay = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        ::epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        ::epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event);
+        auto connection = std::make_unique<Connection>();
+        connection->fd = fd;
+        connection->lastActivity = Clock::now();
+        connections_.emplace(fd, std::move(connection));
+    }
+}
+
+void HttpServer::close(int fd)
+{
+    // Closing the fd also removes it from the epoll set
+    ::close(fd);
+    connections_.erase(fd);
+}
+
+bool HttpServer::receive(Connection& connection)
+{
+    char buffer[4096];
+    while (true) {
+        const auto res = ::recv(connection.fd, buffer, sizeof(buffer), 0);
+        if (res > 0) {
+            connection.input.append(buffer, static_cast<size_t>(res));
+            if (connection.input.size() > maxRequestSize) {
+                close(connection.fd);
+                return false;
+            }
+        } else if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (res == -1 && errno == EINTR) {
+            continue;
+        } else {
+            // Closed by the client or an error
+            close(connection.fd);
+            return false;
+        }
+    }
+    return respond(connection);
+}
+
+bool HttpServer::respond(Connection& connection)
+{
+    // Answers the complete requests in the input one after the other, but only as long as the
+    // responses can be sent right away
+    while (!connection.writing) {
+        const auto headerEnd = connection.input.find("\r\n\r\n");
+        if (headerEnd == std::string::npos) {
+            return true;
+        }
+        const auto request = std::string_view(connection.input).substr(0, headerEnd + 2);
+        const auto requestLineEnd = request.find("\r\n");
+        const auto requestLine = request.substr(0, requestLineEnd);
+        const auto headers = request.substr(requestLineEnd + 2);
+
+        // GET /metrics?foo=bar HTTP/1.1
+        const auto methodEnd = std::min(requestLine.find(' '), requestLine.size());
+        const auto method = requestLine.substr(0, methodEnd);
+        const auto targetEnd = std::min(requestLine.find(' ', methodEnd + 1), requestLine.size());
+        const auto target = requestLine.substr(
+            std::min(methodEnd + 1, requestLine.size()), targetEnd - methodEnd - 1);
+        const auto path = target.substr(0, target.find('?'));
+        const auto version = requestLine.substr(std::min(targetEnd + 1, requestLine.size()));
+
+        const auto connectionHeader = getHeader(headers, "Connection");
+        if (version == "HTTP/1.1") {
+            connection.closeAfterResponse = detail::containsIgnoreCase(connectionHeader, "close");
+        } else {
+            connection.closeAfterResponse
+                = !detail::containsIgnoreCase(connectionHeader, "keep-alive");
+        }
+        // We would have to skip the body to get to the next request
+        const auto contentLength = getHeader(headers, "Content-Length");
+        if ((!contentLength.empty() && contentLength != "0")
+            || !getHeader(headers, "Transfer-Encoding").empty()) {
+            connection.closeAfterResponse = true;
+        }
+
+        const auto head = method == "HEAD";
+        std::string_view status = "200 OK";
+        std::string_view contentType = "text/plain; charset=utf-8";
+        std::string_view contentEncoding;
+        if (method != "GET" && !head) {
+            status = "405 Method Not Allowed";
+            connection.body = "Method Not Allowed\n";
+        } else if (path != options_.path) {
+            status = "404 Not Found";
+            connection.body = "Not Found\n";
+        } else {
+            // Prometheus lists the protobuf format in the Accept header, if it prefers it
+            const auto format
+                = getHeader(headers, "Accept").find("application/vnd.google.protobuf")
+                    != std::string_view::npos
+                ? Format::Protobuf
+                : Format::Text;
+            contentType = cpprom::contentType(format);
+            connection.cached = registry_.serializeCached(format);
+            connection.body = *connection.cached;
+#ifdef CPPROM_ZLIB
+            if (acceptsGzip(getHeader(headers, "Accept-Encoding"))) {
+                connection.compressed.clear();
+                StringSink sink(connection.compressed);
+                GzipSink gzip(sink);
+                gzip.write(*connection.cached);
+                gzip.finish();
+                connection.cached.reset();
+                connection.body = connection.compressed;
+                contentEncoding = "gzip";
+            }
+#endif
+        }
+
+        auto& header = connection.header;
+        header.assign("HTTP/1.1 ").append(status).append("\r\n");
+        header.append("Content-Type: ").append(contentType).append("\r\n");
+        if (!contentEncoding.empty()) {
+            header.append("Content-Encoding: ").append(contentEncoding).append("\r\n");
+        }
+        header.append("Content-Length: ").append(std::to_string(connection.body.size()));
+        header.append("\r\n");
+        if (connection.closeAfterResponse) {
+            header.append("Connection: close\r\n");
+        }
+        header.append("\r\n");
+        if (head) {
+            connection.cached.reset();
+            connection.body = {};
+        }
+        connection.sent = 0;
+        connection.input.erase(0, headerEnd + 4);
+
+        if (!flush(connection)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool HttpServer::flush(Connection& connection)
+{
+    const auto total = connection.header.size() + connection.body.size();
+    while (connection.sent < total) {
+        ::iovec iov[2];
+        size_t count = 0;
+        if (connection.sent < connection.header.size()) {
+            iov[count++] = { connection.header.data() + connection.sent,
+                connection.header.size() - connection.sent };
+        }
+        const auto bodyOffset
+            = connection.sent - std::min(connection.sent, connection.header.size());
+        if (bodyOffset < connection.body.size()) {
+            // writev does not write to the buffers, but iovec is not const
+            iov[count++] = { const_cast<char*>(connection.body.data()) + bodyOffset,
+                connection.body.size() - bodyOffset };
+        }
+        ::msghdr msg {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        // sendmsg is writev with flags, which avoids SIGPIPE if the client is gone
+        const auto res = ::sendmsg(connection.fd, &msg, MSG_NOSIGNAL);
+        if (res >= 0) {
+            connection.sent += static_cast<size_t>(res);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (!connection.writing) {
+                // Wait until the socket is writable and stop reading until the response is sent
+                ::epoll_event event {};
+                event.events = EPOLLOUT;
+                event.data.fd = connection.fd;
+                ::epoll_ctl(epollFd_, EPOLL_CTL_MOD, connection.fd, &event);
+                connection.writing = true;
+            }
+            return true;
+        } else if (errno != EINTR) {
+            close(connection.fd);
+            return false;
+        }
+    }
+
+    connection.cached.reset();
+    connection.body = {};
+    if (connection.closeAfterResponse) {
+        close(connection.fd);
+        return false;
+    }
+    if (connection.writing) {
+        ::epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.fd = connection.fd;
+        ::epoll_ctl(epollFd_, EPOLL_CTL_MOD, connection.fd, &event);
+        connection.writing = false;
+    }
+    return true;
+}
+}
@@ -0,0 +1,654 @@
+#include "cpprom/multiprocess.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.hpp"
+
+// The values are accessed by multiple processes, which only works if the atomics do not need a
+// lock (which would be process-local) and have the same layout as the plain values.
+static_assert(std::atomic<double>::is_always_lock_free && sizeof(std::atomic<double>) == 8);
+static_assert(std::atomic<uint64_t>::is_always_lock_free && sizeof(std::atomic<uint64_t>) == 8);
+
+namespace {
+constexpr std::string_view fileSuffix = ".cpprom";
+constexpr std::array<char, 8> magic { 'c', 'p', 'p', 'r', 'o', 'm', '0', '1' };
+
+// Every entry is this header, followed by the key (padded to 8 bytes) and valueCount values.
+// The key consists of '\0'-terminated fields: type, name, help, extra, the number of labels, the
+// label names and the label values. extra is the mode of gauges and the upper bounds of
+// histograms (separated by ',').
+struct EntryHeader {
+    uint32_t keySize;
+    uint32_t valueCount;
+};
+
+size_t align8(size_t size)
+{
+    return (size + 7) & ~size_t(7);
+}
+
+std::string familyKey(std::string_view type, std::string_view name, std::string_view help,
+    std::string_view extra, const std::vector<std::string>& labelNames)
+{
+    std::string key;
+    for (const auto field : { type, name, help, extra }) {
+        key.append(field).push_back('\0');
+    }
+    key.append(std::to_string(labelNames.size())).push_back('\0');
+    for (const auto& labelName : labelNames) {
+        key.append(labelName).push_back('\0');
+    }
+    return key;
+}
+
+std::string seriesKey(const std::string& familyKey, const cpprom::LabelValues& labelValues)
+{
+    std::string key = familyKey;
+    for (size_t i = 0; i < labelValues.size(); ++i) {
+        key.append(labelValues[i]).push_back('\0');
+    }
+    return key;
+}
+
+template <typename T>
+T* allocate(cpprom::SharedMemorySegment* segment, const std::string& key, uint32_t valueCount)
+{
+    assert(segment && "Use the makeShared* functions to create shared metrics");
+    return static_cast<T*>(segment->allocate(key, valueCount));
+}
+}
+
+namespace cpprom {
+namespace detail {
+    struct SegmentHeader {
+        std::array<char, 8> magic;
+        uint64_t size;
+        uint64_t pid;
+        // The number of bytes of entries after the header. Entries are only appended and this is
+        // only increased after the new entry has been written completely.
+        std::atomic<uint64_t> used;
+    };
+}
+
+using detail::SegmentHeader;
+
+SharedMemorySegment::SharedMemorySegment(const std::string& directory, size_t size)
+{
+    const auto path = directory + "/" + std::to_string(::getpid()) + std::string(fileSuffix);
+    const auto fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        std::cerr << "Could not open " << path << ": " << errno << std::endl;
+        return;
+    }
+
+    // If the file is left over from an earlier process with the same pid, we keep its entries, so
+    // its counters do not go backwards.
+    struct ::stat st;
+    bool reuse = false;
+    if (::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(SegmentHeader)) {
+        SegmentHeader existing;
+        if (::pread(fd, &existing, sizeof(existing), 0) == sizeof(existing)
+            && existing.magic == magic && existing.size == static_cast<size_t>(st.st_size)) {
+            reuse = true;
+            size = existing.size;
+        }
+    }
+    size = std::max(size, sizeof(SegmentHeader));
+    if (!reuse && (::ftruncate(fd, 0) == -1 || ::ftruncate(fd, static_cast<off_t>(size)) == -1)) {
+        std::cerr << "Could not resize " << path << ": " << errno << std::endl;
+        ::close(fd);
+        return;
+    }
+
+    const auto addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        std::cerr << "Could not map " << path << ": " << errno << std::endl;
+        return;
+    }
+    header_ = static_cast<SegmentHeader*>(addr);
+    size_ = size;
+
+    if (reuse) {
+        const auto data = reinterpret_cast<char*>(header_ + 1);
+        const auto used = header_->used.load();
+        for (size_t offset = 0; offset + sizeof(EntryHeader) <= used;) {
+            EntryHeader entry;
+            std::memcpy(&entry, data + offset, sizeof(entry));
+            const auto key = std::string(data + offset + sizeof(entry), entry.keySize);
+            const auto values = data + offset + sizeof(entry) + align8(entry.keySize);
+            slots_.emplace(key, values);
+            offset += sizeof(entry) + align8(entry.keySize) + entry.valueCount * sizeof(uint64_t);
+        }
+    } else {
+        // The file is all zeros, so the magic is written last, so that a reader never sees a
+        // header that is not initialized yet
+        header_->size = size;
+        header_->pid = static_cast<uint64_t>(::getpid());
+        header_->used.store(0);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(header_->magic.data(), magic.data(), magic.size());
+    }
+}
+
+SharedMemorySegment::~SharedMemorySegment()
+{
+    if (header_) {
+        ::munmap(header_, size_);
+    }
+}
+
+bool SharedMemorySegment::mapped() const
+{
+    return header_ != nullptr;
+}
+
+void* SharedMemorySegment::allocate(std::string_view key, uint32_t valueCount)
+{
+    std::lock_guard g(mutex_);
+    auto keyStr = std::string(key);
+    const auto it = slots_.find(keyStr);
+    if (it != slots_.end()) {
+        return it->second;
+    }
+
+    void* values = nullptr;
+    const auto entrySize
+        = sizeof(EntryHeader) + align8(key.size()) + valueCount * sizeof(uint64_t);
+    if (header_) {
+        const auto used = header_->used.load();
+        if (used + entrySize <= size_ - sizeof(SegmentHeader)) {
+            const auto entry = reinterpret_cast<char*>(header_ + 1) + used;
+            const EntryHeader entryHeader { static_cast<uint32_t>(key.size()), valueCount };
+            std::memcpy(entry, &entryHeader, sizeof(entryHeader));
+            std::memcpy(entry + sizeof(entryHeader), key.data(), key.size());
+            // The values are still zero, because entries are never removed
+            values = entry + sizeof(entryHeader) + align8(key.size());
+            header_->used.store(used + entrySize, std::memory_order_release);
+        } else if (fallbackSlots_.empty()) {
+            std::cerr << "Shared memory segment is full, new series will not be exported"
+                      << std::endl;
+        }
+    }
+    if (!values) {
+        values = fallbackSlots_.emplace_back(std::make_unique<uint64_t[]>(valueCount)).get();
+    }
+    slots_.emplace(std::move(keyStr), values);
+    return values;
+}
+
+SharedCounter::SharedCounter(
+    LabelValues labelValues, const Descriptor& descriptor, detail::ChangeFlag* changeFlag)
+    : labelValues_(std::move(labelValues))
+    , segment_(descriptor.segment)
+    , value_(allocate<std::atomic<double>>(
+          segment_.get(), seriesKey(descriptor.key, labelValues_), 1))
+    , changeFlag_(changeFlag)
+{
+}
+
+void SharedCounter::inc(double delta)
+{
+    assert(delta > 0.0);
+    detail::atomicAdd(*value_, delta);
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
+}
+
+double SharedCounter::value() const
+{
+    return value_->load();
+}
+
+const LabelValues& SharedCounter::labelValues() const
+{
+    return labelValues_;
+}
+
+std::pair<double, uint64_t> SharedCounter::activity() const
+{
+    return { value(), 0 };
+}
+
+SharedGauge::SharedGauge(
+    LabelValues labelValues, const Descriptor& descriptor, detail::ChangeFlag* changeFlag)
+    : labelValues_(std::move(labelValues))
+    , segment_(descriptor.segment)
+    , value_(allocate<std::atomic<double>>(
+          segment_.get(), seriesKey(descriptor.key, labelValues_), 1))
+    , changeFlag_(changeFlag)
+{
+}
+
+void SharedGauge::inc(double delta)
+{
+    detail::atomicAdd(*value_, delta);
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
+}
+
+void SharedGauge::dec(double delta)
+{
+    inc(-delta);
+}
+
+void SharedGauge::set(double value)
+{
+    value_->store(value);
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
+}
+
+double SharedGauge::value() const
+{
+    return value_->load();
+}
+
+const LabelValues& SharedGauge::labelValues() const
+{
+    return labelValues_;
+}
+
+std::pair<double, uint64_t> SharedGauge::activity() const
+{
+    return { value(), 0 };
+}
+
+SharedHistogram::SharedHistogram(
+    LabelValues labelValues, const Descriptor& descriptor, detail::ChangeFlag* changeFlag)
+    : labelValues_(std::move(labelValues))
+    , upperBounds_(descriptor.bucketBounds)
+    , segment_(descriptor.segment)
+    , changeFlag_(changeFlag)
+{
+    assert(std::is_sorted(upperBounds_.begin(), upperBounds_.end()));
+    upperBounds_.push_back(std::numeric_limits<double>::infinity());
+    const auto valueCount = static_cast<uint32_t>(upperBounds_.size() + 1);
+    bucketCounts_ = allocate<std::atomic<uint64_t>>(
+        segment_.get(), seriesKey(descriptor.key, labelValues_), valueCount);
+    sum_ = reinterpret_cast<std::atomic<double>*>(bucketCounts_ + upperBounds_.size());
+}
+
+void SharedHistogram::observe(double value)
+{
+    // Like Histogram::observe, NaN is counted in +Inf
+    const auto it = std::partition_point(upperBounds_.begin(), upperBounds_.end(),
+        [value](double upperBound) { return !(value <= upperBound); });
+    const auto bucket = std::min(
+        static_cast<size_t>(it - upperBounds_.begin()), upperBounds_.size() - 1);
+    bucketCounts_[bucket].fetch_add(1, std::memory_order_relaxed);
+    detail::atomicAdd(*sum_, value);
+    if (changeFlag_) {
+        changeFlag_->set();
+    }
+}
+
+const std::vector<double>& SharedHistogram::upperBounds() const
+{
+    return upperBounds_;
+}
+
+Histogram::Snapshot SharedHistogram::snapshot() const
+{
+    Histogram::Snapshot snapshot { std::vector<uint64_t>(upperBounds_.size()), sum_->load(), 0 };
+    for (size_t i = 0; i < upperBounds_.size(); ++i) {
+        snapshot.bucketCounts[i] = bucketCounts_[i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.bucketCounts[i];
+    }
+    return snapshot;
+}
+
+const LabelValues& SharedHistogram::labelValues() const
+{
+    return labelValues_;
+}
+
+std::pair<double, uint64_t> SharedHistogram::activity() const
+{
+    const auto snapshot = this->snapshot();
+    return { snapshot.sum, snapshot.count };
+}
+
+template <>
+void MetricFamily<SharedCounter>::collectSamples(SampleVisitor& visitor) const
+{
+    visitor.family(name_, help_, "counter");
+    for (const auto& child : snapshotChildren()) {
+        const auto& metric = child->metric;
+        visitor.sample(SampleVisitor::SampleRef { name_, {}, labelNames_, metric.labelValues(),
+            metric.value(), {}, {}, child->renderedLabels });
+    }
+    collectOverflows(visitor);
+}
+
+template <>
+void MetricFamily<SharedGauge>::collectSamples(SampleVisitor& visitor) const
+{
+    visitor.family(name_, help_, "gauge");
+    for (const auto& child : snapshotChildren()) {
+        const auto& metric = child->metric;
+        visitor.sample(SampleVisitor::SampleRef { name_, {}, labelNames_, metric.labelValues(),
+            metric.value(), {}, {}, child->renderedLabels });
+    }
+    collectOverflows(visitor);
+}
+
+template <>
+void MetricFamily<SharedHistogram>::collectSamples(SampleVisitor& visitor) const
+{
+    visitor.family(name_, help_, "histogram");
+    for (const auto& child : snapshotChildren()) {
+        const auto& metric = child->metric;
+        const auto& labelValues = metric.labelValues();
+        const auto& rendered = child->renderedLabels;
+        const auto snapshot = metric.snapshot();
+        const auto& upperBounds = metric.upperBounds();
+        uint64_t cumulativeCount = 0;
+        for (size_t i = 0; i < upperBounds.size(); ++i) {
+            cumulativeCount += snapshot.bucketCounts[i];
+            char buf[32];
+            visitor.sample(SampleVisitor::SampleRef { name_, "_bucket", labelNames_, labelValues,
+                static_cast<double>(cumulativeCount), "le",
+                detail::toString(upperBounds[i], buf), rendered,
+                static_cast<int64_t>(cumulativeCount) });
+        }
+        visitor.sample(SampleVisitor::SampleRef {
+            name_, "_sum", labelNames_, labelValues, snapshot.sum, {}, {}, rendered });
+        visitor.sample(SampleVisitor::SampleRef { name_, "_count", labelNames_, labelValues,
+            static_cast<double>(cumulativeCount), {}, {}, rendered,
+            static_cast<int64_t>(cumulativeCount) });
+    }
+    collectOverflows(visitor);
+}
+
+std::shared_ptr<MetricFamily<SharedCounter>> makeSharedCounter(
+    std::shared_ptr<SharedMemorySegment> segment, std::string name,
+    std::vector<std::string> labelNames, std::string help)
+{
+    auto key = familyKey("counter", name, help, {}, labelNames);
+    return std::make_shared<MetricFamily<SharedCounter>>(std::move(name), std::move(labelNames),
+        std::move(help), SharedCounter::Descriptor { std::move(segment), std::move(key) });
+}
+
+std::shared_ptr<MetricFamily<SharedGauge>> makeSharedGauge(
+    std::shared_ptr<SharedMemorySegment> segment, std::string name,
+    std::vector<std::string> labelNames, std::string help, SharedGauge::Mode mode)
+{
+    static constexpr std::array<std::string_view, 4> modes { "all", "sum", "min", "max" };
+    const auto modeName = modes[static_cast<size_t>(mode)];
+    for (const auto& labelName : labelNames) {
+        assert(mode != SharedGauge::Mode::All || labelName != "pid");
+    }
+    auto key = familyKey("gauge", name, help, modeName, labelNames);
+    return std::make_shared<MetricFamily<SharedGauge>>(std::move(name), std::move(labelNames),
+        std::move(help), SharedGauge::Descriptor { std::move(segment), std::move(key) });
+}
+
+std::shared_ptr<MetricFamily<SharedHistogram>> makeSharedHistogram(
+    std::shared_ptr<SharedMemorySegment> segment, std::string name,
+    std::vector<std::string> labelNames, std::vector<double> bucketBounds, std::string help)
+{
+    for (const auto& labelName : labelNames) {
+        assert(labelName != "le");
+    }
+    // The exporter needs the bounds to render le, so they are stored in the "extra" field of the
+    // family key (see EntryHeader), as they are formatted in the output
+    std::string bounds;
+    for (const auto bound : bucketBounds) {
+        char buf[32];
+        bounds.append(detail::toString(bound, buf)).push_back(',');
+    }
+    bounds.append("+Inf");
+    auto key = familyKey("histogram", name, help, bounds, labelNames);
+    return std::make_shared<MetricFamily<SharedHistogram>>(std::move(name), std::move(labelNames),
+        std::move(help),
+        SharedHistogram::Descriptor {
+            std::move(segment), std::move(key), std::move(bucketBounds) });
+}
+
+namespace {
+    class MultiProcessCollector : public Collector {
+    public:
+        MultiProcessCollector(std::string directory)
+            : directory_(std::move(directory))
+        {
+        }
+
+        using Collector::collect;
+
+        Info info() const override { return { "multiprocess" }; }
+
+        std::vector<Family> collect() const override
+        {
+            std::map<std::string, FamilyData, std::less<>> families;
+            if (const auto dir = ::opendir(directory_.c_str())) {
+                while (const auto entry = ::readdir(dir)) {
+                    const auto name = std::string_view(entry->d_name);
+                    if (name.size() > fileSuffix.size()
+                        && name.substr(name.size() - fileSuffix.size()) == fileSuffix) {
+                        readSegment(directory_ + "/" + std::string(name),
+                            name.substr(0, name.size() - fileSuffix.size()), families);
+                    }
+                }
+                ::closedir(dir);
+            } else {
+                std::cerr << "Could not open " << directory_ << ": " << errno << std::endl;
+            }
+
+            std::vector<Family> result;
+            result.reserve(families.size());
+            for (auto& [name, data] : families) {
+                auto& family = result.emplace_back(Family { name, data.help, data.type, {} });
+                for (const auto& [labelValues, values] : data.series) {
+                    const LabelValues seriesLabelValues(labelValues.begin(), labelValues.end());
+                    if (data.type != "histogram") {
+                        family.samples.push_back(
+                            Sample { name, values[0], data.labelNames, seriesLabelValues });
+                        continue;
+                    }
+                    auto bucketLabelNames = data.labelNames;
+                    bucketLabelNames.push_back("le");
+                    auto bucketLabelValues = labelValues;
+                    bucketLabelValues.emplace_back();
+                    // The counts are converted from integers, so they are exact below 2^53
+                    double cumulativeCount = 0.0;
+                    for (size_t i = 0; i < data.upperBounds.size(); ++i) {
+                        cumulativeCount += values[i];
+                        bucketLabelValues.back() = data.upperBounds[i];
+                        family.samples.push_back(Sample { name + "_bucket", cumulativeCount,
+                            bucketLabelNames,
+                            LabelValues(bucketLabelValues.begin(), bucketLabelValues.end()),
+                            static_cast<int64_t>(cumulativeCount) });
+                    }
+                    family.samples.push_back(Sample {
+                        name + "_sum", values.back(), data.labelNames, seriesLabelValues });
+                    family.samples.push_back(Sample { name + "_count", cumulativeCount,
+                        data.labelNames, seriesLabelValues,
+                        static_cast<int64_t>(cumulativeCount) });
+                }
+            }
+            return result;
+        }
+
+    private:
+        struct FamilyData {
+            std::string type;
+            std::string help;
+            std::string extra;
+            std::vector<std::string> labelNames;
+            std::vector<std::string> upperBounds;
+            // Keyed by label values. Holds a single value or the counts and the sum of histograms.
+            std::map<std::vector<std::string>, std::vector<double>> series;
+        };
+
+        static void readSegment(const std::string& path, std::string_view pid,
+            std::map<std::string, FamilyData, std::less<>>& families)
+        {
+            const auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                return;
+            }
+            struct ::stat st;
+            if (::fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(SegmentHeader)) {
+                ::close(fd);
+                return;
+            }
+            const auto size = static_cast<size_t>(st.st_size);
+            const auto addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (addr == MAP_FAILED) {
+                return;
+            }
+
+            // The gauges of exited processes are stale, but their counters still count
+            const auto live = alive(pid);
+            const auto header = static_cast<const SegmentHeader*>(addr);
+            if (header->magic == magic && header->size == size) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                const auto data = reinterpret_cast<const char*>(header + 1);
+                const auto used = std::min(
+                    header->used.load(std::memory_order_acquire), size - sizeof(SegmentHeader));
+                for (size_t offset = 0; offset + sizeof(EntryHeader) <= used;) {
+                    EntryHeader entry;
+                    std::memcpy(&entry, data + offset, sizeof(entry));
+                    const auto keyStart = offset + sizeof(entry);
+                    offset = keyStart + align8(entry.keySize) + entry.valueCount * sizeof(uint64_t);
+                    if (offset > used) {
+                        break;
+                    }
+                    addEntry(std::string_view(data + keyStart, entry.keySize),
+                        data + keyStart + align8(entry.keySize), entry.valueCount, pid, live,
+                        families);
+                }
+            }
+            ::munmap(addr, size);
+        }
+
+        // EPERM means the process exists, but belongs to another user
+        static bool alive(std::string_view pid)
+        {
+            ::pid_t value = 0;
+            if (std::from_chars(pid.data(), pid.data() + pid.size(), value).ec != std::errc()
+                || value <= 0) {
+                return false;
+            }
+            return ::kill(value, 0) == 0 || errno == EPERM;
+        }
+
+        static void addEntry(std::string_view key, const char* valueData, uint32_t valueCount,
+            std::string_view pid, bool live,
+            std::map<std::string, FamilyData, std::less<>>& families)
+        {
+            std::vector<std::string_view> fields;
+            while (!key.empty()) {
+                const auto end = std::min(key.find('\0'), key.size());
+                fields.push_back(key.substr(0, end));
+                key.remove_prefix(std::min(end + 1, key.size()));
+            }
+            size_t labelCount = 0;
+            if (fields.size() < 5
+                || std::from_chars(fields[4].data(), fields[4].data() + fields[4].size(),
+                       labelCount)
+                        .ec
+                    != std::errc()
+                || fields.size() != 5 + 2 * labelCount) {
+                return;
+            }
+            const auto type = fields[0];
+            if (type == "gauge" && !live) {
+                return;
+            }
+            const auto extra = fields[3];
+            const auto perProcess = type == "gauge" && extra == "all";
+
+            auto it = families.find(fields[1]);
+            if (it == families.end()) {
+                it = families.emplace(std::string(fields[1]), FamilyData {}).first;
+                auto& data = it->second;
+                data.type = type;
+                data.help = fields[2];
+                data.extra = extra;
+                data.labelNames.assign(fields.begin() + 5, fields.begin() + 5 + labelCount);
+                if (perProcess) {
+                    data.labelNames.push_back("pid");
+                }
+                if (type == "histogram") {
+                    for (auto bounds = extra; !bounds.empty();) {
+                        const auto end = std::min(bounds.find(','), bounds.size());
+                        data.upperBounds.emplace_back(bounds.substr(0, end));
+                        bounds.remove_prefix(std::min(end + 1, bounds.size()));
+                    }
+                }
+            }
+            auto& data = it->second;
+            // Families with the same name must be the same everywhere
+            if (data.type != type || data.extra != extra
+                || data.labelNames.size() != labelCount + (perProcess ? 1 : 0)) {
+                return;
+            }
+
+            std::vector<double> values;
+            if (type == "histogram") {
+                if (valueCount != data.upperBounds.size() + 1) {
+                    return;
+                }
+                const auto counts = reinterpret_cast<const std::atomic<uint64_t>*>(valueData);
+                for (size_t i = 0; i + 1 < valueCount; ++i) {
+                    values.push_back(static_cast<double>(counts[i].load()));
+                }
+                values.push_back(
+                    reinterpret_cast<const std::atomic<double>*>(counts + valueCount - 1)->load());
+            } else {
+                if (valueCount != 1) {
+                    return;
+                }
+                values.push_back(reinterpret_cast<const std::atomic<double>*>(valueData)->load());
+            }
+
+            std::vector<std::string> labelValues(
+                fields.begin() + 5 + labelCount, fields.begin() + 5 + 2 * labelCount);
+            if (perProcess) {
+                labelValues.emplace_back(pid);
+            }
+            const auto [series, inserted] = data.series.try_emplace(std::move(labelValues), values);
+            if (inserted) {
+                return;
+            }
+            auto& merged = series->second;
+            if (type == "gauge" && extra == "min") {
+                merged[0] = std::min(merged[0], values[0]);
+            } else if (type == "gauge" && extra == "max") {
+                merged[0] = std::max(merged[0], values[0]);
+            } else {
+                for (size_t i = 0; i < merged.size(); ++i) {
+                    merged[i] += values[i];
+                }
+            }
+        }
+
+        std::string directory_;
+    };
+}
+
+std::shared_ptr<Collector> makeMultiProcessCollector(std::string directory)
+{
+    return std::make_shared<MultiProcessCollector>(std::move(directory));
+}
+}
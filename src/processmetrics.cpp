@@ -1,14 +1,21 @@
 #include "cpprom/processmetrics.hpp"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
 #include <cstring>
 #include <iostream>
 #include <optional>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 namespace {
@@ -22,28 +29,6 @@ struct ProcStat {
     long rss; // (24) %ld - Resident set size (number of pages in real memory)
 };
 
-std::optional<ProcStat> procStat()
-{
-    auto f = std::fopen("/proc/self/stat", "r");
-    if (!f) {
-        std::cerr << "Could not open /proc/self/stat" << std::endl;
-        return std::nullopt;
-    }
-    ProcStat procStat;
-    const auto r = std::fscanf(f,
-        "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u "
-        "%*u %*u %*u %lu %lu %*d %*d %*d %*d %ld "
-        "%*d %llu %lu %ld ",
-        &procStat.utime, &procStat.stime, &procStat.num_threads, &procStat.starttime,
-        &procStat.vsize, &procStat.rss);
-    std::fclose(f);
-    if (r != 6) {
-        std::cerr << "Could not parse /proc/self/stat" << std::endl;
-        return std::nullopt;
-    }
-    return procStat;
-}
-
 // If resource is a valid value, this should not fail
 std::optional<unsigned long> getSoftRLimit(int resource)
 {
@@ -54,28 +39,6 @@ std::optional<unsigned long> getSoftRLimit(int resource)
     return rlim.rlim_cur;
 }
 
-std::optional<size_t> countDir(const std::string& path)
-{
-    auto dir = ::opendir(path.c_str());
-    if (!dir) {
-        return std::nullopt;
-    }
-
-    ::dirent* ent;
-    size_t count = 0;
-    while ((ent = ::readdir(dir))) {
-        // Ignore ., .. and potentially other garbage
-        if (ent->d_type != DT_LNK) {
-            continue;
-        }
-        count++;
-    }
-    ::closedir(dir);
-    // We subtract 1, because opendir does openat/getdents64 etc in the background
-    // so that during iteration we saw one extra fd from the directory being read.
-    return count - 1;
-}
-
 std::optional<std::string> readFile(const std::string& path)
 {
     auto fd = ::open(path.c_str(), O_RDONLY);
@@ -117,6 +80,150 @@ std::optional<int64_t> getBootTime()
     return btime;
 }
 
+// Parses the fields that we need from the contents of /proc/self/stat.
+// The format is "pid (comm) state ppid ...", see proc(5). comm may contain spaces and parentheses,
+// so the fields are counted from the last ')'.
+std::optional<ProcStat> parseProcStat(std::string_view str)
+{
+    const auto commEnd = str.rfind(')');
+    if (commEnd == std::string_view::npos) {
+        return std::nullopt;
+    }
+    str.remove_prefix(commEnd + 1);
+
+    ProcStat procStat {};
+    size_t found = 0;
+    // The field after comm is field 3
+    for (size_t field = 3; field <= 24 && !str.empty(); ++field) {
+        const auto start = str.find_first_not_of(' ');
+        if (start == std::string_view::npos) {
+            break;
+        }
+        str.remove_prefix(start);
+        const auto value = str.substr(0, str.find(' '));
+        str.remove_prefix(value.size());
+
+        const auto parse = [value, &found](auto& dest) {
+            const auto res = std::from_chars(value.data(), value.data() + value.size(), dest);
+            if (res.ec == std::errc()) {
+                found++;
+            }
+        };
+        switch (field) {
+        case 14:
+            parse(procStat.utime);
+            break;
+        case 15:
+            parse(procStat.stime);
+            break;
+        case 20:
+            parse(procStat.num_threads);
+            break;
+        case 22:
+            parse(procStat.starttime);
+            break;
+        case 23:
+            parse(procStat.vsize);
+            break;
+        case 24:
+            parse(procStat.rss);
+            break;
+        }
+    }
+    if (found != 6) {
+        return std::nullopt;
+    }
+    return procStat;
+}
+
+// A file that is kept open and read from the start with pread every time, like the files in /proc,
+// which give the current values on every read.
+class ProcFile {
+public:
+    ProcFile() = default;
+
+    ProcFile(const std::string& path, size_t bufferSize = 4096)
+        : fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC))
+        , buffer_(bufferSize)
+    {
+    }
+
+    ~ProcFile()
+    {
+        if (fd_ != -1) {
+            ::close(fd_);
+        }
+    }
+
+    ProcFile(ProcFile&& other)
+        : fd_(std::exchange(other.fd_, -1))
+        , buffer_(std::move(other.buffer_))
+    {
+    }
+
+    ProcFile& operator=(ProcFile&& other)
+    {
+        std::swap(fd_, other.fd_);
+        std::swap(buffer_, other.buffer_);
+        return *this;
+    }
+
+    bool isOpen() const { return fd_ != -1; }
+
+    // The returned view is valid until the next read. Not thread-safe, because of the buffer.
+    // Files bigger than the buffer are cut off.
+    std::optional<std::string_view> read() const
+    {
+        if (fd_ == -1) {
+            return std::nullopt;
+        }
+        const auto size = ::pread(fd_, buffer_.data(), buffer_.size(), 0);
+        if (size < 0) {
+            return std::nullopt;
+        }
+        return std::string_view(buffer_.data(), static_cast<size_t>(size));
+    }
+
+private:
+    int fd_ = -1;
+    mutable std::vector<char> buffer_;
+};
+
+// Not declared by older glibc versions, so we call the syscall directly.
+// The name follows these fields, but we do not need it.
+struct LinuxDirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+};
+
+// Calls func(name, type) for every entry of the directory, starting from the beginning.
+// Returns false if the directory could not be read.
+template <typename Func>
+bool forEachDirEntry(int dirFd, char* buffer, size_t bufferSize, Func&& func)
+{
+    if (dirFd == -1 || ::lseek(dirFd, 0, SEEK_SET) == -1) {
+        return false;
+    }
+    while (true) {
+        const auto size = ::syscall(SYS_getdents64, dirFd, buffer, bufferSize);
+        if (size < 0) {
+            return false;
+        }
+        if (size == 0) {
+            return true;
+        }
+        for (long offset = 0; offset < size;) {
+            const auto ent = reinterpret_cast<const LinuxDirent64*>(buffer + offset);
+            // The null-terminated name directly follows d_type
+            const auto name = reinterpret_cast<const char*>(&ent->d_type) + 1;
+            func(std::string_view(name), ent->d_type);
+            offset += ent->d_reclen;
+        }
+    }
+}
+
 struct ProcessMetrics {
     std::optional<double> cpuSecondsTotal;
     std::optional<uint64_t> openFds;
@@ -128,98 +235,431 @@ struct ProcessMetrics {
     std::optional<uint64_t> threadCount;
 };
 
-ProcessMetrics getProcessMetrics()
+void visitFamily(cpprom::SampleVisitor& visitor, std::string_view name, std::string_view help,
+    std::string_view type, double value)
 {
-    ProcessMetrics metrics;
-    metrics.maxFds = getSoftRLimit(RLIMIT_NOFILE);
-    metrics.virtualMemoryMaxBytes = getSoftRLimit(RLIMIT_AS);
-    metrics.openFds = countDir("/proc/self/fd/");
+    static const std::vector<std::string> labelNames;
+    static const cpprom::LabelValues labelValues;
+    visitor.family(name, help, type);
+    visitor.sample(cpprom::SampleVisitor::SampleRef { name, {}, labelNames, labelValues, value });
+}
 
-    const auto stat = procStat();
-    if (stat) {
-        const auto clockTick = ::sysconf(_SC_CLK_TCK);
-        assert(clockTick > 0);
+// Everything that does not change is determined once and the files that are read on every scrape
+// are kept open, so that collecting is cheap enough to be done every second.
+// Note that after a fork the child would read the parent's /proc/self, so a child process should
+// create a new collector.
+class ProcessMetricsCollector : public cpprom::Collector {
+public:
+    using Collector::collect;
 
-        metrics.cpuSecondsTotal = static_cast<double>(stat->utime + stat->stime) / clockTick;
-        metrics.virtualMemoryBytes = stat->vsize;
-        metrics.residentMemoryBytes = stat->rss * ::getpagesize();
-        metrics.threadCount = stat->num_threads;
+    ProcessMetricsCollector()
+        : clockTick_(::sysconf(_SC_CLK_TCK))
+        , pageSize_(::getpagesize())
+        , statFile_("/proc/self/stat", 1024)
+        , fdDirFd_(::open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+    {
+        assert(clockTick_ > 0);
+        if (!statFile_.isOpen()) {
+            std::cerr << "Could not open /proc/self/stat" << std::endl;
+        }
+        if (fdDirFd_ == -1) {
+            std::cerr << "Could not open /proc/self/fd" << std::endl;
+        }
 
+        // The start time is fixed too
+        const auto stat = procStat();
         const auto bootTime = getBootTime();
-        if (bootTime) {
-            metrics.startTimeSeconds = *bootTime + static_cast<double>(stat->starttime) / clockTick;
+        if (stat && bootTime) {
+            startTimeSeconds_ = *bootTime + static_cast<double>(stat->starttime) / clockTick_;
         }
     }
 
-    return metrics;
-}
+    ~ProcessMetricsCollector()
+    {
+        if (fdDirFd_ != -1) {
+            ::close(fdDirFd_);
+        }
+    }
 
-cpprom::Collector::Family makeFamily(
-    std::string name, std::string help, std::string type, double value)
-{
-    return cpprom::Collector::Family {
-        name,
-        std::move(help),
-        std::move(type),
-        { cpprom::Collector::Sample { name, value, {}, {} } },
-    };
-}
+    ProcessMetricsCollector(const ProcessMetricsCollector&) = delete;
+    ProcessMetricsCollector& operator=(const ProcessMetricsCollector&) = delete;
 
-struct ProcessMetricsCollector : public cpprom::Collector {
-    std::vector<Family> collect() const override
-    {
-        std::vector<Family> families;
+    Info info() const override { return { "process" }; }
 
+    void collect(cpprom::SampleVisitor& visitor) const override
+    {
         const auto metrics = getProcessMetrics();
 
         if (metrics.cpuSecondsTotal) {
-            families.push_back(makeFamily("process_cpu_seconds_total",
+            visitFamily(visitor, "process_cpu_seconds_total",
                 "Total user and system CPU time spent in seconds.", "counter",
-                *metrics.cpuSecondsTotal));
+                *metrics.cpuSecondsTotal);
         }
 
         if (metrics.openFds) {
-            families.push_back(makeFamily("process_open_fds", "Number of open file descriptors.",
-                "gauge", static_cast<double>(*metrics.openFds)));
+            visitFamily(visitor, "process_open_fds", "Number of open file descriptors.", "gauge",
+                static_cast<double>(*metrics.openFds));
         }
 
         if (metrics.maxFds) {
-            families.push_back(
-                makeFamily("process_max_fds", "Maximum number of open file descriptors.", "gauge",
-                    static_cast<double>(*metrics.maxFds)));
+            visitFamily(visitor, "process_max_fds", "Maximum number of open file descriptors.",
+                "gauge", static_cast<double>(*metrics.maxFds));
         }
 
         if (metrics.virtualMemoryBytes) {
-            families.push_back(
-                makeFamily("process_virtual_memory_bytes", "Virtual memory size in bytes.", "gauge",
-                    static_cast<double>(*metrics.virtualMemoryBytes)));
+            visitFamily(visitor, "process_virtual_memory_bytes", "Virtual memory size in bytes.",
+                "gauge", static_cast<double>(*metrics.virtualMemoryBytes));
         }
 
         if (metrics.virtualMemoryMaxBytes) {
-            families.push_back(makeFamily("process_virtual_memory_max_bytes",
+            visitFamily(visitor, "process_virtual_memory_max_bytes",
                 "Maximum amount of virtual memory available in bytes.", "gauge",
-                static_cast<double>(*metrics.virtualMemoryMaxBytes)));
+                static_cast<double>(*metrics.virtualMemoryMaxBytes));
         }
 
         if (metrics.residentMemoryBytes) {
-            families.push_back(
-                makeFamily("process_resident_memory_bytes", "Resident memory size in bytes.",
-                    "gauge", static_cast<double>(*metrics.residentMemoryBytes)));
+            visitFamily(visitor, "process_resident_memory_bytes", "Resident memory size in bytes.",
+                "gauge", static_cast<double>(*metrics.residentMemoryBytes));
         }
 
         if (metrics.startTimeSeconds) {
-            families.push_back(makeFamily("process_start_time_seconds",
+            visitFamily(visitor, "process_start_time_seconds",
                 "Start time of the process since unix epoch in seconds.", "counter",
-                *metrics.startTimeSeconds));
+                *metrics.startTimeSeconds);
         }
 
         if (metrics.threadCount) {
-            families.push_back(makeFamily("process_threads", "Number of OS threads in the process.",
-                "gauge", static_cast<double>(*metrics.threadCount)));
+            visitFamily(visitor, "process_threads", "Number of OS threads in the process.", "gauge",
+                static_cast<double>(*metrics.threadCount));
         }
+    }
 
-        return families;
+private:
+    std::optional<ProcStat> procStat() const
+    {
+        if (!statFile_.isOpen()) {
+            return std::nullopt;
+        }
+        const auto content = statFile_.read();
+        if (!content || content->empty()) {
+            std::cerr << "Could not read /proc/self/stat" << std::endl;
+            return std::nullopt;
+        }
+        const auto stat = parseProcStat(*content);
+        if (!stat) {
+            std::cerr << "Could not parse /proc/self/stat" << std::endl;
+        }
+        return stat;
     }
+
+    std::optional<size_t> countOpenFds() const
+    {
+        size_t count = 0;
+        const auto read = forEachDirEntry(fdDirFd_, direntBuffer_.data(), direntBuffer_.size(),
+            [&count](std::string_view, unsigned char type) {
+                // Ignore . and ..
+                if (type == DT_LNK) {
+                    count++;
+                }
+            });
+        if (!read) {
+            return std::nullopt;
+        }
+        // Do not count the files we keep open ourselves
+        const auto ownFds = static_cast<size_t>(statFile_.isOpen()) + 1;
+        return count >= ownFds ? count - ownFds : 0;
+    }
+
+    ProcessMetrics getProcessMetrics() const
+    {
+        std::lock_guard g(mutex_);
+        ProcessMetrics metrics;
+        metrics.maxFds = getSoftRLimit(RLIMIT_NOFILE);
+        metrics.virtualMemoryMaxBytes = getSoftRLimit(RLIMIT_AS);
+        metrics.openFds = countOpenFds();
+        metrics.startTimeSeconds = startTimeSeconds_;
+
+        const auto stat = procStat();
+        if (stat) {
+            metrics.cpuSecondsTotal = static_cast<double>(stat->utime + stat->stime) / clockTick_;
+            metrics.virtualMemoryBytes = stat->vsize;
+            metrics.residentMemoryBytes = stat->rss * pageSize_;
+            metrics.threadCount = stat->num_threads;
+        }
+        return metrics;
+    }
+
+    long clockTick_;
+    long pageSize_;
+    std::optional<double> startTimeSeconds_;
+    ProcFile statFile_;
+    int fdDirFd_;
+    // The buffers are reused for every scrape
+    mutable CPPROM_MUTEX mutex_;
+    mutable std::array<char, 16 * 1024> direntBuffer_;
+};
+
+// Returns the number after "key" (and an optional ':') at the start of a line, e.g. for
+// "rchar: 123" in /proc/self/io or "nr_throttled 4" in cpu.stat
+std::optional<uint64_t> findValue(std::string_view content, std::string_view key)
+{
+    size_t pos = 0;
+    while (pos < content.size()) {
+        const auto lineEnd = std::min(content.find('\n', pos), content.size());
+        auto line = content.substr(pos, lineEnd - pos);
+        pos = lineEnd + 1;
+        if (line.substr(0, key.size()) != key) {
+            continue;
+        }
+        line.remove_prefix(key.size());
+        if (!line.empty() && line[0] == ':') {
+            line.remove_prefix(1);
+        }
+        // The key must be followed by whitespace, so "usage_usec" does not match "usage"
+        if (line.empty() || (line[0] != ' ' && line[0] != '\t')) {
+            continue;
+        }
+        line.remove_prefix(std::min(line.find_first_not_of(" \t"), line.size()));
+        uint64_t value = 0;
+        if (std::from_chars(line.data(), line.data() + line.size(), value).ec != std::errc()) {
+            return std::nullopt;
+        }
+        return value;
+    }
+    return std::nullopt;
+}
+
+std::optional<uint64_t> parseUint(std::string_view str)
+{
+    uint64_t value = 0;
+    if (std::from_chars(str.data(), str.data() + str.size(), value).ec != std::errc()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+// The directory of the cgroup v2 of this process, e.g. /sys/fs/cgroup/system.slice/foo.service
+std::optional<std::string> getCgroupDir()
+{
+    // With the "hybrid" layout of systemd, the cgroup v2 hierarchy is mounted at unified/
+    std::string root;
+    for (const auto dir : { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" }) {
+        if (::access((std::string(dir) + "/cgroup.controllers").c_str(), F_OK) == 0) {
+            root = dir;
+            break;
+        }
+    }
+    if (root.empty()) {
+        return std::nullopt;
+    }
+    // The line for cgroup v2 is "0::<path>"
+    const auto file = readFile("/proc/self/cgroup");
+    if (!file) {
+        return std::nullopt;
+    }
+    const auto start = file->rfind("0::");
+    if (start == std::string::npos || (start > 0 && (*file)[start - 1] != '\n')) {
+        return std::nullopt;
+    }
+    const auto pathStart = start + 3;
+    const auto path = file->substr(pathStart, file->find('\n', pathStart) - pathStart);
+    return root + (path == "/" ? "" : path);
+}
+
+// All of these are omitted, if they are not available
+class ExtendedProcessMetricsCollector : public cpprom::Collector {
+public:
+    using Collector::collect;
+
+    ExtendedProcessMetricsCollector()
+        : io_("/proc/self/io", 1024)
+        , taskDirFd_(::open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+    {
+        if (const auto cgroupDir = getCgroupDir()) {
+            cpuStat_ = ProcFile(*cgroupDir + "/cpu.stat", 1024);
+            memoryCurrent_ = ProcFile(*cgroupDir + "/memory.current", 64);
+            memoryMax_ = ProcFile(*cgroupDir + "/memory.max", 64);
+        }
+    }
+
+    ~ExtendedProcessMetricsCollector()
+    {
+        if (taskDirFd_ != -1) {
+            ::close(taskDirFd_);
+        }
+    }
+
+    ExtendedProcessMetricsCollector(const ExtendedProcessMetricsCollector&) = delete;
+    ExtendedProcessMetricsCollector& operator=(const ExtendedProcessMetricsCollector&) = delete;
+
+    Info info() const override { return { "process_extended" }; }
+
+    void collect(cpprom::SampleVisitor& visitor) const override
+    {
+        std::lock_guard g(mutex_);
+        const auto counter = [&visitor](std::string_view name, std::string_view help,
+                                 double value) {
+            visitFamily(visitor, name, help, "counter", value);
+        };
+        const auto gauge = [&visitor](std::string_view name, std::string_view help, double value) {
+            visitFamily(visitor, name, help, "gauge", value);
+        };
+
+        ::rusage usage;
+        if (::getrusage(RUSAGE_SELF, &usage) == 0) {
+            counter("process_minor_page_faults_total",
+                "Number of page faults that did not require IO.",
+                static_cast<double>(usage.ru_minflt));
+            counter("process_major_page_faults_total", "Number of page faults that required IO.",
+                static_cast<double>(usage.ru_majflt));
+            counter("process_voluntary_context_switches_total",
+                "Number of times a thread gave up the CPU voluntarily, e.g. to wait for IO.",
+                static_cast<double>(usage.ru_nvcsw));
+            counter("process_involuntary_context_switches_total",
+                "Number of times a thread was preempted by the scheduler.",
+                static_cast<double>(usage.ru_nivcsw));
+        }
+
+        if (const auto io = io_.read()) {
+            const auto ioCounter = [&](std::string_view key, std::string_view name,
+                                       std::string_view help) {
+                if (const auto value = findValue(*io, key)) {
+                    counter(name, help, static_cast<double>(*value));
+                }
+            };
+            ioCounter("rchar", "process_io_read_chars_total",
+                "Number of bytes read with read(2) and similar syscalls, including from caches.");
+            ioCounter("wchar", "process_io_write_chars_total",
+                "Number of bytes written with write(2) and similar syscalls.");
+            ioCounter("read_bytes", "process_io_read_bytes_total",
+                "Number of bytes that were fetched from the storage layer.");
+            ioCounter("write_bytes", "process_io_write_bytes_total",
+                "Number of bytes that were sent to the storage layer.");
+        }
+
+        if (const auto schedstat = processSchedstat()) {
+            counter("process_schedstat_running_seconds_total",
+                "Time the threads of the process spent running on a CPU.",
+                static_cast<double>(schedstat->runTime) / 1e9);
+            counter("process_schedstat_waiting_seconds_total",
+                "Time the threads of the process spent waiting on a runqueue for a CPU.",
+                static_cast<double>(schedstat->waitTime) / 1e9);
+        }
+
+        if (const auto cpuStat = cpuStat_.read()) {
+            const auto cpuCounter = [&](std::string_view key, std::string_view name,
+                                        std::string_view help, double factor) {
+                if (const auto value = findValue(*cpuStat, key)) {
+                    counter(name, help, static_cast<double>(*value) * factor);
+                }
+            };
+            cpuCounter("usage_usec", "process_cgroup_cpu_usage_seconds_total",
+                "CPU time used by the cgroup of the process.", 1e-6);
+            cpuCounter("nr_periods", "process_cgroup_cpu_periods_total",
+                "Number of enforcement periods of the CPU limit of the cgroup.", 1.0);
+            cpuCounter("nr_throttled", "process_cgroup_cpu_throttled_periods_total",
+                "Number of periods in which the cgroup was throttled.", 1.0);
+            cpuCounter("throttled_usec", "process_cgroup_cpu_throttled_seconds_total",
+                "Time the cgroup was throttled for.", 1e-6);
+        }
+
+        if (const auto current = memoryCurrent_.read()) {
+            if (const auto value = parseUint(*current)) {
+                gauge("process_cgroup_memory_usage_bytes",
+                    "Memory used by the cgroup of the process.", static_cast<double>(*value));
+            }
+        }
+
+        // This is "max" if there is no limit
+        if (const auto max = memoryMax_.read()) {
+            if (const auto value = parseUint(*max)) {
+                gauge("process_cgroup_memory_limit_bytes",
+                    "Memory limit of the cgroup of the process.", static_cast<double>(*value));
+            }
+        }
+    }
+
+private:
+    // In nanoseconds
+    struct Schedstat {
+        uint64_t runTime = 0;
+        uint64_t waitTime = 0;
+    };
+
+    // "<time on cpu in ns> <time waiting on a runqueue in ns> <number of timeslices>"
+    std::optional<Schedstat> threadSchedstat(std::string_view tid) const
+    {
+        const auto path = std::string(tid) + "/schedstat";
+        const auto fd = ::openat(taskDirFd_, path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return std::nullopt; // The thread exited in the meantime
+        }
+        const auto size = ::pread(fd, schedstatBuffer_.data(), schedstatBuffer_.size(), 0);
+        ::close(fd);
+        if (size <= 0) {
+            return std::nullopt;
+        }
+        const auto content = std::string_view(schedstatBuffer_.data(), static_cast<size_t>(size));
+        const auto second = content.find(' ');
+        const auto third = content.find(' ', second + 1);
+        const auto runTime = parseUint(content.substr(0, second));
+        const auto waitTime = parseUint(content.substr(second + 1, third - second - 1));
+        if (second == std::string_view::npos || !runTime || !waitTime) {
+            return std::nullopt;
+        }
+        return Schedstat { *runTime, *waitTime };
+    }
+
+    // The sum over all threads. The values of a thread disappear with it, so the last values that
+    // were read from threads that exited since are kept, so that the sum never decreases.
+    // mutex_ has to be locked.
+    std::optional<Schedstat> processSchedstat() const
+    {
+        std::unordered_map<pid_t, Schedstat> threads;
+        const auto read = forEachDirEntry(taskDirFd_, direntBuffer_.data(), direntBuffer_.size(),
+            [this, &threads](std::string_view name, unsigned char type) {
+                pid_t tid = 0;
+                const auto res = std::from_chars(name.data(), name.data() + name.size(), tid);
+                if (type != DT_DIR || res.ec != std::errc()) {
+                    return; // . and ..
+                }
+                if (const auto schedstat = threadSchedstat(name)) {
+                    threads.emplace(tid, *schedstat);
+                }
+            });
+        if (!read || threads.empty()) {
+            return std::nullopt;
+        }
+
+        for (const auto& [tid, last] : threads_) {
+            const auto it = threads.find(tid);
+            // Lower values mean that the thread exited and its id was reused
+            if (it == threads.end() || it->second.runTime < last.runTime
+                || it->second.waitTime < last.waitTime) {
+                exitedThreads_.runTime += last.runTime;
+                exitedThreads_.waitTime += last.waitTime;
+            }
+        }
+        auto sum = exitedThreads_;
+        for (const auto& [tid, schedstat] : threads) {
+            sum.runTime += schedstat.runTime;
+            sum.waitTime += schedstat.waitTime;
+        }
+        threads_ = std::move(threads);
+        return sum;
+    }
+
+    ProcFile io_;
+    int taskDirFd_;
+    ProcFile cpuStat_;
+    ProcFile memoryCurrent_;
+    ProcFile memoryMax_;
+    // For the buffers of the files and the schedstat of the threads
+    mutable CPPROM_MUTEX mutex_;
+    mutable std::array<char, 16 * 1024> direntBuffer_;
+    mutable std::array<char, 256> schedstatBuffer_;
+    mutable std::unordered_map<pid_t, Schedstat> threads_;
+    mutable Schedstat exitedThreads_;
 };
 }
 
@@ -228,4 +668,9 @@ std::shared_ptr<cpprom::Collector> makeProcessMetricsCollector()
 {
     return std::make_shared<ProcessMetricsCollector>();
 }
+
+std::shared_ptr<cpprom::Collector> makeExtendedProcessMetricsCollector()
+{
+    return std::make_shared<ExtendedProcessMetricsCollector>();
+}
 }
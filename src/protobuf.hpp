@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Only used by the .cpp files, so this is not installed with the public headers
+namespace cpprom {
+namespace detail {
+    // https://protobuf.dev/programming-guides/encoding/
+    namespace protobuf {
+        enum class WireType : uint8_t {
+            Varint = 0,
+            Fixed64 = 1,
+            Len = 2,
+        };
+
+        inline void writeVarint(std::string& buf, uint64_t value)
+        {
+            while (value >= 0x80) {
+                buf.push_back(static_cast<char>((value & 0x7f) | 0x80));
+                value >>= 7;
+            }
+            buf.push_back(static_cast<char>(value));
+        }
+
+        inline void writeTag(std::string& buf, uint32_t field, WireType type)
+        {
+            writeVarint(buf, (static_cast<uint64_t>(field) << 3) | static_cast<uint8_t>(type));
+        }
+
+        inline void writeUint64(std::string& buf, uint32_t field, uint64_t value)
+        {
+            writeTag(buf, field, WireType::Varint);
+            writeVarint(buf, value);
+        }
+
+        // For int64 fields, which encode negative values as 10 byte varints
+        inline void writeInt64(std::string& buf, uint32_t field, int64_t value)
+        {
+            writeUint64(buf, field, static_cast<uint64_t>(value));
+        }
+
+        inline void writeDouble(std::string& buf, uint32_t field, double value)
+        {
+            writeTag(buf, field, WireType::Fixed64);
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            for (size_t i = 0; i < 8; ++i) {
+                buf.push_back(static_cast<char>((bits >> (i * 8)) & 0xff));
+            }
+        }
+
+        // For sint32 and sint64 fields
+        inline uint64_t zigZag(int64_t value)
+        {
+            return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+        }
+
+        inline void writeSint64(std::string& buf, uint32_t field, int64_t value)
+        {
+            writeUint64(buf, field, zigZag(value));
+        }
+
+        // Also used for nested messages, which are encoded like strings
+        inline void writeBytes(std::string& buf, uint32_t field, std::string_view data)
+        {
+            writeTag(buf, field, WireType::Len);
+            writeVarint(buf, data.size());
+            buf.append(data);
+        }
+    }
+}
+}
@@ -0,0 +1,355 @@
+#include "cpprom/push.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <iostream>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "protobuf.hpp"
+#include "util.hpp"
+
+namespace {
+// Builds a prometheus.WriteRequest with one TimeSeries per sample
+// https://github.com/prometheus/prometheus/blob/main/prompb/remote.proto
+class RemoteWriteBuilder : public cpprom::SampleVisitor {
+public:
+    RemoteWriteBuilder(std::string& request, int64_t timestampMs)
+        : request_(request)
+        , timestampMs_(timestampMs)
+    {
+    }
+
+    void family(std::string_view, std::string_view, std::string_view) override { }
+
+    void sample(const SampleRef& sample) override
+    {
+        using namespace cpprom::detail::protobuf;
+        name_.assign(sample.name).append(sample.suffix);
+        labels_.clear();
+        labels_.emplace_back("__name__", name_);
+        for (size_t i = 0; i < sample.labelNames.size(); ++i) {
+            labels_.emplace_back(sample.labelNames[i], sample.labelValues[i]);
+        }
+        if (!sample.extraLabelName.empty()) {
+            labels_.emplace_back(sample.extraLabelName, sample.extraLabelValue);
+        }
+        // The labels have to be sorted by name
+        std::sort(labels_.begin(), labels_.end());
+
+        series_.clear();
+        for (const auto& [name, value] : labels_) {
+            label_.clear();
+            writeBytes(label_, 1, name); // name
+            writeBytes(label_, 2, value); // value
+            writeBytes(series_, 1, label_); // TimeSeries.labels
+        }
+        label_.clear();
+        writeDouble(label_, 1, sample.value); // value
+        writeInt64(label_, 2, timestampMs_); // timestamp
+        writeBytes(series_, 2, label_); // TimeSeries.samples
+        writeBytes(request_, 1, series_); // WriteRequest.timeseries
+    }
+
+private:
+    std::string& request_;
+    int64_t timestampMs_;
+    std::string name_;
+    std::vector<std::pair<std::string_view, std::string_view>> labels_;
+    std::string series_;
+    std::string label_;
+};
+
+// https://github.com/google/snappy/blob/main/format_description.txt
+// A snappy block that only consists of literals is valid, it is just not compressed. Remote write
+// requires snappy, but the requests are small enough that this does not matter much.
+std::string snappyLiterals(std::string_view data)
+{
+    std::string out;
+    out.reserve(data.size() + data.size() / 65536 * 3 + 16);
+    // The uncompressed length is a varint too
+    cpprom::detail::protobuf::writeVarint(out, data.size());
+    while (!data.empty()) {
+        const auto size = std::min(data.size(), size_t(65536));
+        // Tag 61 << 2: literal with a 2 byte (little-endian) length - 1
+        out.push_back(static_cast<char>(61 << 2));
+        out.push_back(static_cast<char>((size - 1) & 0xff));
+        out.push_back(static_cast<char>((size - 1) >> 8));
+        out.append(data.substr(0, size));
+        data.remove_prefix(size);
+    }
+    return out;
+}
+
+// Sets the timeouts of socket to the time left until deadline. Returns false if there is none.
+// Linux also applies SO_SNDTIMEO to connect.
+bool setTimeout(int socket, std::chrono::steady_clock::time_point deadline)
+{
+    const auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (left.count() <= 0) {
+        return false;
+    }
+    const ::timeval timeout { static_cast<time_t>(left.count() / 1'000'000),
+        static_cast<suseconds_t>(left.count() % 1'000'000) };
+    ::setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return true;
+}
+
+bool sendAll(int socket, std::string_view data, std::chrono::steady_clock::time_point deadline)
+{
+    while (!data.empty()) {
+        if (!setTimeout(socket, deadline)) {
+            return false;
+        }
+        const auto res = ::send(socket, data.data(), data.size(), MSG_NOSIGNAL);
+        if (res <= 0) {
+            return false;
+        }
+        data.remove_prefix(static_cast<size_t>(res));
+    }
+    return true;
+}
+
+}
+
+namespace cpprom {
+Pusher::Pusher(const Registry& registry, Options options)
+    : registry_(registry)
+    , options_(std::move(options))
+{
+    // http://host[:port][/path]
+    std::string_view url = options_.url;
+    const std::string_view scheme = "http://";
+    assert(url.substr(0, scheme.size()) == scheme && "Only http:// URLs are supported");
+    url.remove_prefix(std::min(scheme.size(), url.size()));
+    const auto pathStart = std::min(url.find('/'), url.size());
+    const auto hostPort = url.substr(0, pathStart);
+    path_ = pathStart < url.size() ? std::string(url.substr(pathStart)) : "/";
+    const auto colon = hostPort.rfind(':');
+    // IPv6 addresses are in brackets and contain colons themselves
+    if (colon != std::string_view::npos && hostPort.find(']', colon) == std::string_view::npos) {
+        host_ = hostPort.substr(0, colon);
+        port_ = hostPort.substr(colon + 1);
+    } else {
+        host_ = hostPort;
+        port_ = "80";
+    }
+    if (host_.size() >= 2 && host_.front() == '[' && host_.back() == ']') {
+        host_ = host_.substr(1, host_.size() - 2);
+    }
+
+#ifdef CPPROM_SINGLE_THREADED
+    // The registry is not thread-safe in this configuration
+    assert(options_.interval <= 0.0 && "Periodic pushes need thread-safety");
+    options_.interval = 0.0;
+#endif
+    if (options_.interval > 0.0) {
+        thread_ = std::thread(&Pusher::run, this);
+    }
+}
+
+Pusher::~Pusher()
+{
+    if (thread_.joinable()) {
+        {
+            std::lock_guard g(stopMutex_);
+            stop_ = true;
+        }
+        stopCondition_.notify_all();
+        thread_.join();
+    }
+    // The last values of a batch job are usually the most important ones
+    push();
+    disconnect();
+}
+
+bool Pusher::push()
+{
+    std::lock_guard g(pushMutex_);
+    body_.clear();
+    if (options_.protocol == Protocol::RemoteWrite) {
+        const auto now = std::chrono::system_clock::now().time_since_epoch();
+        RemoteWriteBuilder builder(
+            body_, std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+        registry_.collect(builder);
+        return send("POST", "application/x-protobuf", "snappy", snappyLiterals(body_));
+    }
+    StringSink sink(body_);
+    registry_.serialize(sink, options_.format);
+    return send("PUT", contentType(options_.format), {}, body_);
+}
+
+void Pusher::run()
+{
+    const auto interval = std::chrono::duration<double>(options_.interval);
+    std::unique_lock lock(stopMutex_);
+    while (!stopCondition_.wait_for(lock, interval, [this] { return stop_; })) {
+        lock.unlock();
+        push();
+        lock.lock();
+    }
+}
+
+bool Pusher::send(std::string_view method, std::string_view contentType,
+    std::string_view contentEncoding, std::string_view body)
+{
+    request_.assign(method).append(" ").append(path_).append(" HTTP/1.1\r\n");
+    request_.append("Host: ").append(host_).append("\r\n");
+    request_.append("Content-Type: ").append(contentType).append("\r\n");
+    if (!contentEncoding.empty()) {
+        request_.append("Content-Encoding: ").append(contentEncoding).append("\r\n");
+        request_.append("X-Prometheus-Remote-Write-Version: 0.1.0\r\n");
+    }
+    request_.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n\r\n");
+
+    // Every blocking call only gets the time that is left, so the destructor can not hang
+    deadline_ = std::chrono::steady_clock::now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(options_.timeout));
+
+    // The server may have closed a connection that we kept open, so we try again once with a new
+    // connection, if that one fails.
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        const auto reused = socket_ != -1;
+        if (!reused && !connect()) {
+            return false;
+        }
+        if (!sendAll(socket_, request_, deadline_) || !sendAll(socket_, body, deadline_)) {
+            disconnect();
+            if (reused) {
+                continue;
+            }
+            std::cerr << "Could not send push request to " << options_.url << std::endl;
+            return false;
+        }
+
+        // Read the response headers and then the body, so the connection can be reused
+        std::string response;
+        size_t headerEnd = std::string::npos;
+        char buffer[4096];
+        while (headerEnd == std::string::npos) {
+            if (!setTimeout(socket_, deadline_)) {
+                break;
+            }
+            const auto res = ::recv(socket_, buffer, sizeof(buffer), 0);
+            if (res <= 0) {
+                break;
+            }
+            response.append(buffer, static_cast<size_t>(res));
+            headerEnd = response.find("\r\n\r\n");
+        }
+        if (headerEnd == std::string::npos) {
+            disconnect();
+            if (reused && response.empty()) {
+                continue;
+            }
+            std::cerr << "Could not receive push response from " << options_.url << std::endl;
+            return false;
+        }
+
+        // "HTTP/1.1 200 OK"
+        int status = 0;
+        const auto statusStart = std::min(response.find(' '), response.size()) + 1;
+        std::from_chars(response.data() + std::min(statusStart, response.size()),
+            response.data() + response.size(), status);
+
+        std::optional<size_t> contentLength;
+        bool close = false;
+        for (size_t pos = response.find("\r\n") + 2; pos < headerEnd;) {
+            const auto lineEnd = response.find("\r\n", pos);
+            const auto line = std::string_view(response).substr(pos, lineEnd - pos);
+            if (detail::startsWithIgnoreCase(line, "content-length:")) {
+                size_t length = 0;
+                const auto value = line.substr(line.find_first_not_of(' ', 15));
+                std::from_chars(value.data(), value.data() + value.size(), length);
+                contentLength = length;
+            } else if (detail::startsWithIgnoreCase(line, "connection:")) {
+                close = line.find("close") != std::string_view::npos;
+            }
+            pos = lineEnd + 2;
+        }
+
+        // Without a Content-Length (e.g. chunked) we cannot tell where the response ends
+        if (contentLength && !close) {
+            const auto received = response.size() - headerEnd - 4;
+            auto remaining = *contentLength - std::min(*contentLength, received);
+            while (remaining > 0) {
+                if (!setTimeout(socket_, deadline_)) {
+                    close = true;
+                    break;
+                }
+                const auto res = ::recv(socket_, buffer, std::min(sizeof(buffer), remaining), 0);
+                if (res <= 0) {
+                    close = true;
+                    break;
+                }
+                remaining -= static_cast<size_t>(res);
+            }
+        } else {
+            close = true;
+        }
+        if (close) {
+            disconnect();
+        }
+
+        if (status < 200 || status >= 300) {
+            std::cerr << "Push to " << options_.url << " failed with status " << status
+                      << std::endl;
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool Pusher::connect()
+{
+    ::addrinfo hints {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    ::addrinfo* addrs = nullptr;
+    if (::getaddrinfo(host_.c_str(), port_.c_str(), &hints, &addrs) != 0) {
+        std::cerr << "Could not resolve " << host_ << std::endl;
+        return false;
+    }
+
+    for (auto addr = addrs; addr; addr = addr->ai_next) {
+        const auto fd = ::socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            continue;
+        }
+        if (!setTimeout(fd, deadline_)) {
+            ::close(fd);
+            break;
+        }
+        const int noDelay = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        if (::connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+            socket_ = fd;
+            break;
+        }
+        ::close(fd);
+    }
+    ::freeaddrinfo(addrs);
+    if (socket_ == -1) {
+        std::cerr << "Could not connect to " << host_ << ":" << port_ << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void Pusher::disconnect()
+{
+    if (socket_ != -1) {
+        ::close(socket_);
+        socket_ = -1;
+    }
+}
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <string_view>
+
+// Only used by the .cpp files, so this is not installed with the public headers
+namespace cpprom {
+namespace detail {
+    // ASCII only, which is all that HTTP headers need
+    inline char toLower(char ch)
+    {
+        return ch >= 'A' && ch <= 'Z' ? static_cast<char>(ch - 'A' + 'a') : ch;
+    }
+
+    inline bool equalsIgnoreCase(std::string_view a, std::string_view b)
+    {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); ++i) {
+            if (toLower(a[i]) != toLower(b[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline bool startsWithIgnoreCase(std::string_view str, std::string_view prefix)
+    {
+        return str.size() >= prefix.size()
+            && equalsIgnoreCase(str.substr(0, prefix.size()), prefix);
+    }
+
+    inline bool containsIgnoreCase(std::string_view str, std::string_view needle)
+    {
+        for (size_t i = 0; i + needle.size() <= str.size(); ++i) {
+            if (equalsIgnoreCase(str.substr(i, needle.size()), needle)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Removes spaces and tabs from both ends
+    inline std::string_view trim(std::string_view str)
+    {
+        const auto start = str.find_first_not_of(" \t");
+        if (start == std::string_view::npos) {
+            return {};
+        }
+        const auto end = str.find_last_not_of(" \t");
+        return str.substr(start, end - start + 1);
+    }
+
+    // std::atomic<double>::fetch_add is only available since C++20
+    inline void atomicAdd(std::atomic<double>& value, double delta)
+    {
+        auto current = value.load();
+        while (!value.compare_exchange_weak(current, current + delta)) {
+            // pass
+        }
+    }
+
+    // Formats a sample value or bucket bound for the text format. Returns a view into buf.
+    inline std::string_view toString(double num, char (&buf)[32])
+    {
+        if (num == std::numeric_limits<double>::infinity()) {
+            return "+Inf";
+        }
+        if (num == -std::numeric_limits<double>::infinity()) {
+            return "-Inf";
+        }
+        if (std::isnan(num)) {
+            return "NaN";
+        }
+
+        // Without a format, to_chars produces the shortest representation that round-trips,
+        // using scientific notation if it is shorter. That is at most 24 characters.
+        const auto res = std::to_chars(buf, buf + sizeof(buf), num);
+        assert(res.ec == std::errc());
+        return std::string_view(buf, res.ptr - buf);
+    }
+}
+}
@@ -0,0 +1,60 @@
+#include <cstdio>
+#include <string>
+
+#include <cpprom/cpprom.hpp>
+
+// Old-style collectors (Collector::collect() returning Families) have "le" and "quantile" as
+// regular labels. Their protobuf output has to be the same as that of the MetricFamily they were
+// collected from, i.e. one metric per series with the buckets/quantiles inside of it.
+
+namespace {
+class FamiliesCollector : public cpprom::Collector {
+public:
+    FamiliesCollector(std::vector<Family> families)
+        : families_(std::move(families))
+    {
+    }
+
+    using Collector::collect;
+
+    std::vector<Family> collect() const override { return families_; }
+
+private:
+    std::vector<Family> families_;
+};
+
+bool check(const cpprom::Collector& collector, const char* name)
+{
+    const FamiliesCollector families(collector.collect());
+    bool ok = true;
+    for (const auto format : { cpprom::Format::Text, cpprom::Format::Protobuf }) {
+        std::string expected, actual;
+        cpprom::StringSink expectedSink(expected), actualSink(actual);
+        collector.serialize(expectedSink, format);
+        families.serialize(actualSink, format);
+        if (actual != expected) {
+            std::fprintf(stderr, "%s: %s output of the Families differs\n", name,
+                format == cpprom::Format::Text ? "text" : "protobuf");
+            ok = false;
+        }
+    }
+    return ok;
+}
+}
+
+int main()
+{
+    cpprom::Registry registry;
+    auto& histogram = registry.histogram(
+        "request_duration_seconds", { "method" }, { 0.1, 0.5, 1.0 }, "Request duration");
+    histogram.labels("GET").observe(0.05);
+    histogram.labels("GET").observe(0.7);
+    histogram.labels("POST").observe(2.0);
+
+    auto& summary = registry.summary("response_size_bytes", { "method" }, "Response size");
+    summary.labels("GET").observe(100.0);
+    summary.labels("GET").observe(2000.0);
+
+    const auto ok = check(histogram, "histogram") && check(summary, "summary");
+    return ok ? 0 : 1;
+}